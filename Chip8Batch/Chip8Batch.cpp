@@ -0,0 +1,346 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+
+/* Chip8Batch
+* Runs many independent Chip8 instances headless on a work-stealing pool and
+* reports the final framebuffer hash, cycle count and error state of each.
+* Needs neither SDL nor windows.h.
+*
+* Usage: Chip8Batch [-j threads] [-f frames] [-i ips] [-n copies] [-l lanes] [-x] [-c] [-s seed] [-r episode] [-k script] <rom>...
+*/
+
+#include "Chip8.h"
+#include "Chip8Jit.h"
+#include "Chip8Lanes.h"
+#include "InputScript.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Rom {
+	std::string name;
+	std::vector<BYTE> code;
+	std::shared_ptr<const Chip8State> image; // loaded once, every Chip8 copy starts from it
+};
+
+// Copies [first, first + count) of one ROM, more than one only in lane mode
+struct Job {
+	size_t rom;
+	unsigned first;
+	unsigned count;
+};
+
+struct Result {
+	uint64_t hash;
+	uint64_t cycles;
+	DWORD frames;
+	BOOL error;
+	BOOL mismatch;  // lane or JIT and reference Chip8 parted ways, at frames
+	uint64_t resets;
+	double reset_seconds; // spent inside Chip8::reset
+};
+
+struct Options {
+	unsigned threads = std::thread::hardware_concurrency();
+	DWORD frames = 600;     // 10 seconds of emulated time
+	DWORD ips = 600;
+	unsigned copies = 1;
+	unsigned lanes = 0;     // copies run in lockstep by one Chip8Lanes, 0 for one Chip8 each
+	bool jit = false;       // run each copy through Chip8Jit
+	bool check = false;     // run a Chip8 next to every lane or JIT and compare them each frame
+	uint64_t seed = 0;      // copy c of every ROM is seeded with seed + c
+	DWORD episode = 0;      // frames between resets, 0 for none
+	InputScript script;
+};
+
+// FNV-1a over the rows, leftmost pixel first
+static uint64_t hash_screen(const uint64_t screen[32])
+{
+	uint64_t h = 1469598103934665603ULL;
+	for (int y = 0; y < 32; ++y) {
+		for (int b = 56; b >= 0; b -= 8) {
+			h ^= (screen[y] >> b) & 0xFF;
+			h *= 1099511628211ULL;
+		}
+	}
+	return h;
+}
+
+static Chip8* new_chip(const Rom& rom, unsigned copy, const Options& opt)
+{
+	// Chip8 carries its whole memory (and the decode cache), keep it off the worker's stack
+	Chip8* chip = new Chip8;
+
+	chip->set_quiet(true);
+	chip->seed(opt.seed + copy);
+	chip->initialize();
+	chip->load_image(rom.image);
+	chip->set_ips(opt.ips);
+	return chip;
+}
+
+static BOOL same_state(const Chip8& a, const Chip8& b)
+{
+	std::unique_ptr<Chip8State> sa(new Chip8State), sb(new Chip8State);
+	a.save_state(*sa);
+	b.save_state(*sb);
+	return memcmp(sa.get(), sb.get(), sizeof(Chip8State)) == 0;
+}
+
+static Result run_one(const Rom& rom, unsigned copy, const Options& opt)
+{
+	Result r = {};
+	std::unique_ptr<Chip8> chip(new_chip(rom, copy, opt));
+	std::unique_ptr<Chip8Jit> jit(opt.jit ? new Chip8Jit(*chip) : nullptr);
+	// Stepped through Chip8::run_frame next to the JIT
+	std::unique_ptr<Chip8> ref(opt.check ? new_chip(rom, copy, opt) : nullptr);
+
+	for (r.frames = 0; r.frames < opt.frames; ++r.frames) {
+		DWORD frame = r.frames;
+		if (opt.episode > 0) {
+			frame %= opt.episode;
+			if (frame == 0 && r.frames > 0) {
+				auto start = std::chrono::steady_clock::now();
+				chip->reset();
+				r.reset_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				r.resets++;
+				if (ref) ref->reset();
+			}
+		}
+		chip->set_keys(opt.script.keys_at(frame));
+		DWORD executed = 0;
+		RunResult result = jit ? jit->run_frame(&executed) : chip->run_frame(&executed);
+		r.cycles += executed;
+		if (ref) {
+			DWORD expected = 0;
+			ref->set_keys(opt.script.keys_at(frame));
+			chip8_profile.pause(true);
+			ref->run_frame(&expected);
+			chip8_profile.pause(false);
+			if (executed != expected || !same_state(*chip, *ref)) {
+				r.mismatch = true;
+				break;
+			}
+		}
+		if (result == RUN_ERROR) {
+			r.error = true;
+			break;
+		}
+	}
+	r.hash = hash_screen(chip->screen);
+	return r;
+}
+
+static void run_lanes(const Rom& rom, const Job& job, const Options& opt, Result* out)
+{
+	unsigned count = job.count;
+	Chip8Lanes lanes(count);
+	for (unsigned i = 0; i < count; ++i)
+		lanes.seed(i, opt.seed + job.first + i);
+	lanes.load(rom.code.data(), rom.code.size());
+	lanes.set_ips(opt.ips);
+
+	std::vector<std::unique_ptr<Chip8>> refs;
+	std::vector<uint64_t> ref_cycles(count);
+	if (opt.check) {
+		for (unsigned i = 0; i < count; ++i)
+			refs.emplace_back(new_chip(rom, job.first + i, opt));
+	}
+
+	for (unsigned i = 0; i < count; ++i)
+		out[i] = Result{ 0, 0, opt.frames, false, false, 0, 0 };
+	for (DWORD frame = 0; frame < opt.frames; ++frame) {
+		WORD keys = opt.script.keys_at(frame);
+		for (unsigned i = 0; i < count; ++i)
+			lanes.set_keys(i, keys);
+		lanes.run_frame();
+		for (unsigned i = 0; i < count; ++i) {
+			if (opt.check && !out[i].mismatch) {
+				Chip8& chip = *refs[i];
+				chip.set_keys(keys);
+				if (!chip.has_error()) {
+					DWORD executed = 0;
+					chip8_profile.pause(true);
+					chip.run_frame(&executed);
+					chip8_profile.pause(false);
+					ref_cycles[i] += executed;
+				}
+				if (!lanes.compare(i, chip, ref_cycles[i])) {
+					out[i].mismatch = true;
+					out[i].frames = frame;
+				}
+			}
+			if (lanes.has_error(i) && !out[i].error) {
+				out[i].error = true;
+				if (!out[i].mismatch) out[i].frames = frame;
+			}
+		}
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		out[i].hash = hash_screen(lanes.screen(i));
+		out[i].cycles = lanes.cycles(i);
+	}
+}
+
+static void usage()
+{
+	std::cerr << "Usage: Chip8Batch [-j threads] [-f frames] [-i ips] [-n copies] [-l lanes] [-x] [-c] [-s seed] [-r episode] [-k script] <rom>..." << std::endl
+		<< "  -j  worker threads (default: one per hardware thread)" << std::endl
+		<< "  -f  60Hz frames to run per instance (default 600)" << std::endl
+		<< "  -i  instructions per second (default 600)" << std::endl
+		<< "  -n  instances per ROM (default 1)" << std::endl
+		<< "  -l  experimental: run the instances of a ROM in lockstep, this many per group." << std::endl
+		<< "      Faster only while they stay in step, slower than the default on most ROMs" << std::endl
+		<< "  -x  run every instance through the x86-64 JIT" << std::endl
+		<< "  -c  with -l or -x, check every lane or instance against a Chip8 each frame" << std::endl
+		<< "  -s  random seed of the first instance, the next ones count up from it (default 0)" << std::endl
+		<< "  -r  reset every instance after this many frames, the input script starting over" << std::endl
+		<< "  -k  input script, \"<frame> <hex key mask>\" per line" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	std::vector<Rom> roms;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-c") {
+			opt.check = true;
+			continue;
+		}
+		if (arg == "-x") {
+			opt.jit = true;
+			continue;
+		}
+		if (arg.size() == 2 && arg[0] == '-') {
+			if (i + 1 >= argc) {
+				usage();
+				return 1;
+			}
+			const char* value = argv[++i];
+			switch (arg[1]) {
+			case 'j': opt.threads = (unsigned)atoi(value); break;
+			case 'f': opt.frames = (DWORD)atol(value); break;
+			case 'i': opt.ips = (DWORD)atol(value); break;
+			case 'n': opt.copies = (unsigned)atoi(value); break;
+			case 'l': opt.lanes = (unsigned)atoi(value); break;
+			case 's': opt.seed = strtoull(value, nullptr, 0); break;
+			case 'r': opt.episode = (DWORD)atol(value); break;
+			case 'k':
+				if (!opt.script.load(value)) {
+					std::cerr << "Failed to read input script " << value << std::endl;
+					return 1;
+				}
+				break;
+			default:
+				usage();
+				return 1;
+			}
+			continue;
+		}
+
+		int filesize = 0;
+		LPBYTE buffer = load_application(arg, filesize);
+		if (buffer == nullptr || filesize <= 0) return 1;
+		Rom rom;
+		rom.name = arg.substr(arg.find_last_of("/\\") + 1);
+		rom.code.assign(buffer, buffer + filesize);
+		std::unique_ptr<Chip8> first(new Chip8);
+		first->set_quiet(true);
+		first->initialize();
+		first->load_code(buffer, filesize);
+		rom.image = first->image();
+		delete[] buffer;
+		roms.push_back(rom);
+	}
+	if (roms.empty() || opt.copies == 0 || (opt.check && opt.lanes == 0 && !opt.jit) || (opt.jit && opt.lanes > 0) ||
+		(opt.episode > 0 && opt.lanes > 0)) {
+		usage();
+		return 1;
+	}
+
+	std::vector<Job> jobs;
+	unsigned width = opt.lanes > 0 ? opt.lanes : 1;
+	for (size_t r = 0; r < roms.size(); ++r)
+		for (unsigned c = 0; c < opt.copies; c += width)
+			jobs.push_back(Job{ r, c, std::min(width, opt.copies - c) });
+	// Result of copy c of ROM r at r * copies + c
+	std::vector<Result> results(roms.size() * opt.copies);
+
+	// CHIP8_PROFILE builds: every worker counts into its own chip8_profile,
+	// added up here after each job
+	std::unique_ptr<OpProfile<chip8_profiling>> profile(new OpProfile<chip8_profiling>());
+	std::mutex profile_lock;
+
+	TaskPool pool(opt.threads);
+	auto start = std::chrono::steady_clock::now();
+	pool.run(jobs.size(), [&](size_t task, unsigned) {
+		const Job& job = jobs[task];
+		Result* out = &results[job.rom * opt.copies + job.first];
+		if (opt.lanes > 0)
+			run_lanes(roms[job.rom], job, opt, out);
+		else
+			*out = run_one(roms[job.rom], job.first, opt);
+		if (chip8_profiling) {
+			std::lock_guard<std::mutex> lock(profile_lock);
+			profile->merge(chip8_profile);
+			chip8_profile.clear();
+		}
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t total = 0;
+	unsigned errors = 0;
+	unsigned mismatches = 0;
+	uint64_t resets = 0;
+	double reset_seconds = 0;
+	printf("%-16s %5s %8s %12s %-16s %s\n", "rom", "copy", "frames", "cycles", "screen", "status");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		printf("%-16s %5u %8lu %12llu %016llx %s\n", roms[i / opt.copies].name.c_str(), (unsigned)(i % opt.copies),
+			(unsigned long)r.frames, (unsigned long long)r.cycles, (unsigned long long)r.hash,
+			r.mismatch ? "mismatch" : r.error ? "error" : "ok");
+		total += r.cycles;
+		errors += r.error ? 1 : 0;
+		mismatches += r.mismatch ? 1 : 0;
+		resets += r.resets;
+		reset_seconds += r.reset_seconds;
+	}
+	printf("%zu instances on %u threads, %u errors: %llu instructions in %.3fs, %.0f instr/s\n",
+		results.size(), pool.workers(), errors, (unsigned long long)total, seconds,
+		seconds > 0 ? total / seconds : 0.0);
+	if (resets > 0)
+		printf("%llu resets, %.0f resets/s per thread (%.0fns each)\n", (unsigned long long)resets,
+			resets / reset_seconds, reset_seconds / resets * 1e9);
+	if (opt.check)
+		printf("%u %s differ from their reference\n", mismatches, opt.jit ? "instances" : "lanes");
+	if (chip8_profiling)
+		profile->dump(stdout);
+	return mismatches ? 3 : errors ? 2 : 0;
+}
@@ -0,0 +1,82 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for a fixed set of tasks. Tasks are dealt round-robin to
+// one deque per worker; a worker takes from the back of its own deque and,
+// once that is empty, steals from the front of the others. No task creates
+// more tasks, so a worker is done when every deque is empty.
+class TaskPool {
+public:
+	explicit TaskPool(unsigned workers) : queues(workers > 0 ? workers : 1) {}
+
+	unsigned workers() const { return (unsigned)queues.size(); }
+
+	// Calls fn(task, worker) for every task in [0, tasks) and returns when all are done
+	void run(size_t tasks, const std::function<void(size_t, unsigned)>& fn) {
+		for (size_t i = 0; i < tasks; ++i)
+			queues[i % queues.size()].tasks.push_back(i);
+
+		std::vector<std::thread> threads;
+		for (unsigned w = 0; w < queues.size(); ++w)
+			threads.emplace_back([this, w, &fn] { _work(w, fn); });
+		for (std::thread& t : threads)
+			t.join();
+	}
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<size_t> tasks;
+	};
+	std::vector<Queue> queues;
+
+	void _work(unsigned w, const std::function<void(size_t, unsigned)>& fn) {
+		size_t task;
+		while (_pop(w, task) || _steal(w, task))
+			fn(task, w);
+	}
+
+	bool _pop(unsigned w, size_t& task) {
+		std::lock_guard<std::mutex> guard(queues[w].lock);
+		if (queues[w].tasks.empty()) return false;
+		task = queues[w].tasks.back();
+		queues[w].tasks.pop_back();
+		return true;
+	}
+
+	bool _steal(unsigned w, size_t& task) {
+		for (size_t k = 1; k < queues.size(); ++k) {
+			Queue& victim = queues[(w + k) % queues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (victim.tasks.empty()) continue;
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			return true;
+		}
+		return false;
+	}
+};
@@ -0,0 +1,359 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+
+/* Chip8Bench
+* Throughput benchmark: runs every ROM in a directory headless, single
+* threaded, for a fixed number of instructions with scripted input, and
+* writes instructions per second, ns per instruction and the share of DXYN
+* per ROM as JSON.
+*
+* Usage: Chip8Bench [-n instructions] [-i ips] [-k script] [-o out.json] [-p dir] [-x] [roms dir or files...]
+*/
+
+#define _CRT_SECURE_NO_WARNINGS // fopen
+
+#include "Chip8.h"
+#include "Chip8Jit.h"
+#include "InputScript.h"
+#include "Json.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+struct Options {
+	uint64_t instructions = 10000000;
+	DWORD ips = 600;
+	InputScript script;     // empty for the built-in sequence
+	std::string out;        // stdout when empty
+	std::string profile;    // where CHIP8_PROFILE builds write per-ROM reports
+	bool jit = false;       // run through Chip8Jit, checked against Chip8::run_cycles afterwards
+};
+
+struct Result {
+	std::string name;
+	uint64_t instructions;  // executed, the timings are per one of these
+	uint64_t fast_forwarded; // passed over in delay timer waits
+	uint64_t draws;         // DXYN
+	uint64_t clears;        // 00E0
+	DWORD frames;
+	double seconds;
+	BOOL error;
+	BOOL mismatch;          // the JIT ended up somewhere else than the interpreter
+	// Built with CHIP8_PROFILE only
+	uint64_t ops[OP_KINDS];
+	uint64_t skipped[OP_KINDS];
+};
+
+// *.rom in dir, sorted by name
+static std::vector<std::string> list_roms(const std::string& dir)
+{
+	std::vector<std::string> names;
+#ifdef _WIN32
+	WIN32_FIND_DATAA found;
+	HANDLE h = FindFirstFileA((dir + "\\*.rom").c_str(), &found);
+	if (h != INVALID_HANDLE_VALUE) {
+		do {
+			names.push_back(dir + "\\" + found.cFileName);
+		} while (FindNextFileA(h, &found));
+		FindClose(h);
+	}
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d != nullptr) {
+		while (dirent* e = readdir(d)) {
+			std::string name = e->d_name;
+			if (name.size() > 4 && name.compare(name.size() - 4, 4, ".rom") == 0)
+				names.push_back(dir + "/" + name);
+		}
+		closedir(d);
+	}
+#endif
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+static bool is_dir(const std::string& path)
+{
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(path.c_str());
+	return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	DIR* d = opendir(path.c_str());
+	if (d != nullptr) closedir(d);
+	return d != nullptr;
+#endif
+}
+
+// Without a script every key in turn, held 8 frames out of 16
+static WORD keys_at(const Options& opt, DWORD frame)
+{
+	if (!opt.script.empty()) return opt.script.keys_at(frame);
+	return frame % 16 < 8 ? (WORD)(1 << (frame / 16 * 7 % 16)) : 0;
+}
+
+static Result run_rom(const std::string& path, const Options& opt)
+{
+	Result r = {};
+	r.name = path.substr(path.find_last_of("/\\") + 1);
+
+	int filesize = 0;
+	LPBYTE buffer = load_application(path, filesize);
+	if (buffer == nullptr || filesize <= 0) {
+		r.error = true;
+		return r;
+	}
+	std::unique_ptr<Chip8> chip(new Chip8);
+	chip->set_quiet(true);
+	chip->initialize();
+	chip->load_code(buffer, filesize);
+	chip->set_ips(opt.ips);
+	std::unique_ptr<Chip8Jit> jit(opt.jit ? new Chip8Jit(*chip) : nullptr);
+	// Replays the same frames through Chip8::run_cycles once the clock has stopped
+	std::unique_ptr<Chip8> ref;
+	if (jit) {
+		ref.reset(new Chip8);
+		ref->set_quiet(true);
+		ref->initialize();
+		ref->load_code(buffer, filesize);
+		ref->set_ips(opt.ips);
+	}
+	delete[] buffer;
+
+	// The same loop as Chip8::run_frame, stopping on every draw to tell DXYN from 00E0.
+	// A ROM stuck waiting for a key the script never presses gives up after as many
+	// frames as the instructions would take at full speed, ten times over
+	uint64_t max_frames = opt.instructions * 60 / opt.ips * 10 + 600;
+	uint64_t emulated = 0;
+	chip8_profile.clear();
+	auto start = std::chrono::steady_clock::now();
+	while (emulated < opt.instructions && r.frames < max_frames && !r.error) {
+		chip->set_keys(keys_at(opt, r.frames));
+		DWORD vblank = chip->vblank_count();
+		while (chip->vblank_count() == vblank) {
+			DWORD executed = 0;
+			RunResult result = jit ? jit->run(chip->cycles_to_vblank(), &executed)
+				: chip->run_cycles(chip->cycles_to_vblank(), &executed);
+			emulated += executed;
+			if (result == RUN_DRAW) {
+				if ((chip->peek(chip->get_pc() - 2) & 0xF0) == 0xD0) r.draws++;
+				else r.clears++;
+			}
+			else if (result == RUN_KEY_WAIT) {
+				chip->idle(chip->cycles_to_vblank());
+			}
+			else if (result == RUN_ERROR) {
+				r.error = true;
+				break;
+			}
+		}
+		r.frames++;
+	}
+	r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	r.fast_forwarded = chip->fast_forwarded_count();
+	r.instructions = emulated - r.fast_forwarded;
+	if (ref) {
+		uint64_t expected = 0;
+		chip8_profile.pause(true);
+		for (DWORD frame = 0; frame < r.frames && !ref->has_error(); ++frame) {
+			DWORD executed = 0;
+			ref->set_keys(keys_at(opt, frame));
+			ref->run_frame(&executed);
+			expected += executed;
+		}
+		chip8_profile.pause(false);
+		Chip8State a, b;
+		chip->save_state(a);
+		ref->save_state(b);
+		r.mismatch = expected != emulated || memcmp(&a, &b, sizeof(Chip8State)) != 0;
+	}
+	for (int k = 0; k < OP_KINDS; ++k) {
+		r.ops[k] = chip8_profile.executed((OpKind)k);
+		r.skipped[k] = chip8_profile.skipped((OpKind)k);
+	}
+	if (chip8_profiling && !opt.profile.empty()) {
+		// <rom>.txt with the opcode counts and hot blocks, <rom>.folded for flamegraph.pl
+		std::string base = opt.profile + "/" + r.name.substr(0, r.name.find_last_of('.'));
+		if (FILE* f = fopen((base + ".txt").c_str(), "w")) {
+			chip8_profile.dump(f);
+			chip8_profile.report(f, *chip);
+			fclose(f);
+		}
+		if (FILE* f = fopen((base + ".folded").c_str(), "w")) {
+			chip8_profile.write_stacks(f, *chip);
+			fclose(f);
+		}
+	}
+	return r;
+}
+
+static void write_result(FILE* f, const Result& r, const Options& opt, const char* indent)
+{
+	double ips = r.seconds > 0 ? r.instructions / r.seconds : 0;
+	double ns = r.instructions > 0 ? r.seconds * 1e9 / r.instructions : 0;
+	double share = r.instructions > 0 ? (double)r.draws / r.instructions : 0;
+	fprintf(f, "%s\"instructions\": %llu,\n", indent, (unsigned long long)r.instructions);
+	fprintf(f, "%s\"fast_forwarded\": %llu,\n", indent, (unsigned long long)r.fast_forwarded);
+	fprintf(f, "%s\"frames\": %lu,\n", indent, (unsigned long)r.frames);
+	fprintf(f, "%s\"seconds\": %.6f,\n", indent, r.seconds);
+	fprintf(f, "%s\"instructions_per_second\": %.0f,\n", indent, ips);
+	fprintf(f, "%s\"ns_per_instruction\": %.3f,\n", indent, ns);
+	fprintf(f, "%s\"dxyn\": %llu,\n", indent, (unsigned long long)r.draws);
+	fprintf(f, "%s\"cls\": %llu,\n", indent, (unsigned long long)r.clears);
+	fprintf(f, "%s\"dxyn_share\": %.6f,\n", indent, share);
+	if (chip8_profiling) {
+		// Executions per opcode, adding up to instructions, and for skips how many
+		// of them skipped
+		const char* sep = "";
+		fprintf(f, "%s\"ops\": {", indent);
+		for (int k = 0; k < OP_KINDS; ++k) {
+			if (r.ops[k] == 0) continue;
+			fprintf(f, "%s\"%s\": %llu", sep, chip8_op_name((OpKind)k), (unsigned long long)r.ops[k]);
+			sep = ", ";
+		}
+		sep = "";
+		fprintf(f, "},\n%s\"skipped\": {", indent);
+		for (int k = 0; k < OP_KINDS; ++k) {
+			if (r.skipped[k] == 0) continue;
+			fprintf(f, "%s\"%s\": %llu", sep, chip8_op_name((OpKind)k), (unsigned long long)r.skipped[k]);
+			sep = ", ";
+		}
+		fprintf(f, "},\n");
+	}
+	if (opt.jit)
+		fprintf(f, "%s\"mismatch\": %s,\n", indent, r.mismatch ? "true" : "false");
+	fprintf(f, "%s\"error\": %s\n", indent, r.error ? "true" : "false");
+}
+
+static void usage()
+{
+	std::cerr << "Usage: Chip8Bench [-n instructions] [-i ips] [-k script] [-o out.json] [-p dir] [-x] [roms dir or files...]" << std::endl
+		<< "  -n  instructions to run per ROM (default 10000000)" << std::endl
+		<< "  -i  instructions per second of emulated time (default 600)" << std::endl
+		<< "  -k  input script, \"<frame> <hex key mask>\" per line (default: each key in turn)" << std::endl
+		<< "  -o  JSON output file (default stdout)" << std::endl
+		<< "  -p  directory for per-ROM opcode, hot block and call stack reports (CHIP8_PROFILE builds)" << std::endl
+		<< "  -x  run through the x86-64 JIT, then check the final state against the interpreter" << std::endl
+		<< "ROMs default to roms/*.rom, a directory stands for the *.rom in it, any other file is run as a ROM" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	Options opt;
+	std::vector<std::string> paths;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-x") {
+			opt.jit = true;
+			continue;
+		}
+		if (arg.size() == 2 && arg[0] == '-') {
+			if (i + 1 >= argc) {
+				usage();
+				return 1;
+			}
+			const char* value = argv[++i];
+			switch (arg[1]) {
+			case 'n': opt.instructions = strtoull(value, nullptr, 0); break;
+			case 'i': opt.ips = (DWORD)atol(value); break;
+			case 'o': opt.out = value; break;
+			case 'p': opt.profile = value; break;
+			case 'k':
+				if (!opt.script.load(value)) {
+					std::cerr << "Failed to read input script " << value << std::endl;
+					return 1;
+				}
+				break;
+			default:
+				usage();
+				return 1;
+			}
+			continue;
+		}
+		if (is_dir(arg)) {
+			std::vector<std::string> found = list_roms(arg);
+			paths.insert(paths.end(), found.begin(), found.end());
+		}
+		else {
+			paths.push_back(arg);
+		}
+	}
+	if (paths.empty())
+		paths = list_roms("roms");
+	if (paths.empty() || opt.ips == 0 || opt.instructions == 0) {
+		usage();
+		return 1;
+	}
+
+	std::vector<Result> results;
+	Result total = {};
+	for (const std::string& path : paths) {
+		results.push_back(run_rom(path, opt));
+		const Result& r = results.back();
+		std::cerr << r.name << ": " << (r.seconds > 0 ? (uint64_t)(r.instructions / r.seconds) : 0)
+			<< " instr/s" << (r.error ? " (error)" : "") << (r.mismatch ? " (mismatch)" : "") << std::endl;
+		total.instructions += r.instructions;
+		total.fast_forwarded += r.fast_forwarded;
+		total.draws += r.draws;
+		total.clears += r.clears;
+		total.frames += r.frames;
+		total.seconds += r.seconds;
+		total.error |= r.error;
+		total.mismatch |= r.mismatch;
+		for (int k = 0; k < OP_KINDS; ++k) {
+			total.ops[k] += r.ops[k];
+			total.skipped[k] += r.skipped[k];
+		}
+	}
+
+	FILE* f = opt.out.empty() ? stdout : fopen(opt.out.c_str(), "w");
+	if (f == nullptr) {
+		std::cerr << "Failed to write " << opt.out << std::endl;
+		return 1;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "  \"ips\": %lu,\n", (unsigned long)opt.ips);
+	fprintf(f, "  \"instructions_per_rom\": %llu,\n", (unsigned long long)opt.instructions);
+	fprintf(f, "  \"input\": \"%s\",\n", opt.script.empty() ? "builtin" : "script");
+	fprintf(f, "  \"core\": \"%s\",\n", opt.jit ? "jit" : "interpreter");
+	fprintf(f, "  \"roms\": [\n");
+	for (size_t i = 0; i < results.size(); ++i) {
+		fprintf(f, "    {\n      \"rom\": \"%s\",\n", json_escape(results[i].name).c_str());
+		write_result(f, results[i], opt, "      ");
+		fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ],\n  \"total\": {\n");
+	write_result(f, total, opt, "    ");
+	fprintf(f, "  }\n}\n");
+	if (f != stdout) fclose(f);
+	return total.mismatch ? 3 : total.error ? 2 : 0;
+}
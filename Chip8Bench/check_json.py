@@ -0,0 +1,55 @@
+"""Runs Chip8Bench on a ROM and checks that what it writes to stdout is JSON.
+
+Usage: python check_json.py <Chip8Bench executable> [rom, default roms/pong.rom]
+Same as Chip8Bench rom | python -m json.tool, plus a look at the fields. Where
+the file system allows it the ROM is also run under a name with a quote and a
+tab in it, which have to come back unchanged.
+"""
+
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+
+def check(bench, rom):
+	run = subprocess.run([bench, "-n", "100000", rom], stdout=subprocess.PIPE)
+	try:
+		doc = json.loads(run.stdout.decode("utf-8"))
+	except ValueError as e:
+		return "stdout is not JSON: %s" % e
+	if len(doc["roms"]) != 1 or doc["roms"][0]["rom"] != os.path.basename(rom):
+		return "expected one entry for %r" % os.path.basename(rom)
+	# Whole frames are run, so the last one can go past -n
+	if doc["total"]["instructions"] + doc["total"]["fast_forwarded"] < 100000:
+		return "total falls short of -n"
+	return None
+
+
+def main():
+	if len(sys.argv) < 2:
+		print(__doc__.strip(), file=sys.stderr)
+		return 1
+	bench = sys.argv[1]
+	rom = sys.argv[2] if len(sys.argv) > 2 else os.path.join("roms", "pong.rom")
+
+	error = check(bench, rom)
+	if error is None and os.name != "nt":
+		tmp = tempfile.mkdtemp()
+		try:
+			odd = os.path.join(tmp, "say \"hi\"\tnow.ch8")
+			shutil.copyfile(rom, odd)
+			error = check(bench, odd)
+		finally:
+			shutil.rmtree(tmp)
+	if error is not None:
+		print(error, file=sys.stderr)
+		return 1
+	print("ok")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,337 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+
+/* Chip8Recompiler
+* Translates a ROM ahead of time into a C++ file with one function per basic
+* block, to be compiled next to Chip8Native.cpp and run through Chip8Native.
+*
+* Usage: Chip8Recompiler <rom> <output.cpp> [symbol]
+*/
+
+#include "Chip8.h"
+#include "Chip8Native.h"
+
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cctype>
+
+struct BlockInfo {
+	WORD start;
+	WORD end;
+	WORD count;
+	std::string body;
+};
+
+class Recompiler {
+public:
+	Recompiler(const BYTE* rom, int size) : rom(rom), size(size) {}
+
+	void analyze() {
+		// Recursive descent from the entry point, every reachable target starts a block
+		std::vector<WORD> work;
+		work.push_back(0x200);
+		while (!work.empty()) {
+			WORD pc = work.back();
+			work.pop_back();
+			if (!_in_rom(pc) || done.count(pc)) continue;
+			done.insert(pc);
+
+			std::vector<WORD> next;
+			BlockInfo b = _translate(pc, next);
+			if (b.count > 0) blocks.push_back(b);
+			for (WORD t : next) work.push_back(t);
+		}
+	}
+
+	void emit(std::ostream& os, const std::string& symbol, const std::string& rom_name) {
+		os << "// Generated by Chip8Recompiler from " << _comment(rom_name) << ", do not edit\n"
+			<< "#include \"Chip8Native.h\"\n\n"
+			<< "typedef Chip8Native N;\n\n";
+		for (const BlockInfo& b : blocks) {
+			os << "static DWORD " << _block_name(b.start) << "(Chip8& c)\n{\n"
+				<< "\tBYTE* V = N::regs(c);\n"
+				<< b.body << "}\n\n";
+		}
+		os << "static const Chip8NativeBlock blocks[] = {\n";
+		for (const BlockInfo& b : blocks) {
+			os << "\t{ " << _hex(b.start) << ", " << _hex(b.end) << ", " << b.count << ", "
+				<< _block_name(b.start) << " },\n";
+		}
+		os << "};\n\nstatic const BYTE rom[] = {";
+		for (int i = 0; i < size; ++i) {
+			os << (i % 16 ? " " : "\n\t") << _hex(rom[i], 2) << ",";
+		}
+		os << "\n};\n\n"
+			<< "extern const Chip8NativeImage " << symbol << " = {\n"
+			<< "\t\"" << _c_string(rom_name) << "\", rom, sizeof(rom), blocks, sizeof(blocks) / sizeof(blocks[0])\n"
+			<< "};\n";
+	}
+
+	size_t block_count() { return blocks.size(); }
+
+private:
+	const BYTE* rom;
+	int size;
+	std::set<WORD> done;
+	std::vector<BlockInfo> blocks;
+
+	BOOL _in_rom(WORD addr) { return addr >= 0x200 && addr + 1 < 0x200 + size; }
+	WORD _fetch(WORD addr) { return rom[addr - 0x200] << 8 | rom[addr - 0x200 + 1]; }
+
+	static std::string _hex(DWORD v, int digits = 4) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "0x%0*X", digits, (unsigned)v);
+		return buf;
+	}
+	// name as the body of a C string literal
+	static std::string _c_string(const std::string& name) {
+		std::string out;
+		for (char ch : name) {
+			unsigned char u = (unsigned char)ch;
+			if (ch == '"' || ch == '\\') {
+				out += '\\';
+				out += ch;
+			}
+			else if (u < 0x20 || u == 0x7F) {
+				// Octal takes at most 3 digits, so a digit after it can't run on
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\%03o", u);
+				out += buf;
+			}
+			else out += ch;
+		}
+		return out;
+	}
+	// name on a // comment line: no line breaks, and no backslash to splice the next line on
+	static std::string _comment(const std::string& name) {
+		std::string out = name;
+		for (char& ch : out) {
+			if (ch == '\\') ch = '/';
+			else if ((unsigned char)ch < 0x20 || ch == 0x7F) ch = '?';
+		}
+		return out;
+	}
+	static std::string _block_name(WORD addr) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "block_%03X", addr);
+		return buf;
+	}
+	static std::string _reg(int r) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "V[0x%X]", r);
+		return buf;
+	}
+
+	BlockInfo _translate(WORD pc, std::vector<WORD>& next) {
+		BlockInfo b;
+		b.start = pc;
+		b.count = 0;
+		std::ostringstream os;
+		WORD addr = pc;
+		BOOL ends_block = false;
+
+		while (!ends_block && b.count < Chip8Native::max_block_ops && _in_rom(addr)) {
+			WORD op = _fetch(addr);
+			if (!_emit_op(os, addr, op, next, ends_block)) {
+				// Left to the interpreter, carry on after it
+				next.push_back(addr);
+				next.push_back(addr + 2);
+				break;
+			}
+			++b.count;
+			addr += 2;
+		}
+		if (!ends_block) {
+			os << "\treturn " << _hex(addr) << ";\n";
+			next.push_back(addr);
+		}
+		b.end = addr;
+		b.body = os.str();
+		return b;
+	}
+
+	// Every instruction is followed by a timer tick, exactly like emulate_cycle
+	BOOL _emit_op(std::ostream& os, WORD pc, WORD op, std::vector<WORD>& next, BOOL& ends_block) {
+		const std::string vx = _reg(BIT2(op));
+		const std::string vy = _reg(BIT1(op));
+		const std::string nn = _hex(LOW8(op), 2);
+		const std::string nnn = _hex(ADDR(op), 3);
+		const std::string skip = _hex(pc + 4);
+		const std::string follow = _hex(pc + 2);
+
+		os << "\t// " << _hex(pc, 3) << ": " << _hex(op) << "\n";
+		switch (chip8_op_kind(op))
+		{
+		case OP_CLS:
+			os << "\tN::cls(c);\n";
+			ends_block = true;
+			break;
+		case OP_RET:
+			os << "\t{ DWORD next = N::stack(c)[--N::SP(c) & 15] + 2; N::tick(c); return next; }\n";
+			ends_block = true;
+			return true;
+		case OP_JP:
+			os << "\tN::tick(c);\n\treturn " << nnn << ";\n";
+			next.push_back(ADDR(op));
+			ends_block = true;
+			return true;
+		case OP_CALL:
+			os << "\tN::stack(c)[N::SP(c)++ & 15] = " << _hex(pc) << ";\n"
+				<< "\tN::tick(c);\n\treturn " << nnn << ";\n";
+			next.push_back(ADDR(op));
+			next.push_back(pc + 2);
+			ends_block = true;
+			return true;
+		case OP_SE_IMM:
+		case OP_SNE_IMM:
+		case OP_SE_REG:
+		case OP_SNE_REG:
+		case OP_SKP:
+		case OP_SKNP: {
+			std::string cond;
+			switch (chip8_op_kind(op)) {
+			case OP_SE_IMM:  cond = vx + " == " + nn; break;
+			case OP_SNE_IMM: cond = vx + " != " + nn; break;
+			case OP_SE_REG:  cond = vx + " == " + vy; break;
+			case OP_SNE_REG: cond = vx + " != " + vy; break;
+			case OP_SKP:     cond = "N::key(c, " + vx + ")"; break;
+			default:         cond = "!N::key(c, " + vx + ")"; break;
+			}
+			os << "\t{ BOOL skip = " << cond << "; N::tick(c); return skip ? "
+				<< skip << " : " << follow << "; }\n";
+			next.push_back(pc + 2);
+			next.push_back(pc + 4);
+			ends_block = true;
+			return true;
+		}
+		case OP_LD_IMM:   os << "\t" << vx << " = " << nn << ";\n"; break;
+		case OP_ADD_IMM:  os << "\t" << vx << " += " << nn << ";\n"; break;
+		case OP_LD_REG:   os << "\t" << vx << " = " << vy << ";\n"; break;
+		case OP_OR:       os << "\t" << vx << " |= " << vy << ";\n"; break;
+		case OP_AND:      os << "\t" << vx << " &= " << vy << ";\n"; break;
+		case OP_XOR:      os << "\t" << vx << " ^= " << vy << ";\n"; break;
+		case OP_ADD_REG:
+			os << "\tV[0xF] = " << vy << " > (0xFF - " << vx << ");\n"
+				<< "\t" << vx << " += " << vy << ";\n";
+			break;
+		case OP_SUB:
+			os << "\tV[0xF] = " << vy << " <= " << vx << ";\n"
+				<< "\t" << vx << " -= " << vy << ";\n";
+			break;
+		case OP_SHR:
+			os << "\tV[0xF] = " << vx << " & 0x1;\n"
+				<< "\t" << vx << " >>= 1;\n";
+			break;
+		case OP_SUBN:
+			os << "\tV[0xF] = " << vx << " <= " << vy << ";\n"
+				<< "\t" << vx << " = " << vy << " - " << vx << ";\n";
+			break;
+		case OP_SHL:
+			os << "\tV[0xF] = " << vx << " >> 7;\n"
+				<< "\t" << vx << " <<= 1;\n";
+			break;
+		case OP_LD_I:     os << "\tN::IR(c) = " << nnn << ";\n"; break;
+		case OP_JP_V0:
+			os << "\t{ DWORD next = " << nnn << " + V[0x0]; N::tick(c); return next; }\n";
+			ends_block = true;
+			return true;
+		case OP_RND:      os << "\t" << vx << " = N::rnd(c) & " << nn << ";\n"; break;
+		case OP_DRW:
+			os << "\tN::draw(c, " << vx << ", " << vy << ", " << BIT0(op) << ");\n";
+			ends_block = true;
+			break;
+		case OP_LD_VX_DT: os << "\t" << vx << " = N::delay(c);\n"; break;
+		case OP_LD_DT:    os << "\tN::delay(c) = " << vx << ";\n"; break;
+		case OP_LD_ST:    os << "\tN::sound(c) = " << vx << ";\n"; break;
+		case OP_ADD_I:
+			os << "\tV[0xF] = N::IR(c) + " << vx << " > 0xFFF;\n"
+				<< "\tN::IR(c) += " << vx << ";\n";
+			break;
+		case OP_LD_F:     os << "\tN::IR(c) = " << vx << " * 0x5;\n"; break;
+		case OP_LD_BCD:
+			// Memory writes may hit code, so the runner looks up the next block again
+			os << "\tN::bcd(c, " << vx << ");\n";
+			ends_block = true;
+			break;
+		case OP_LD_STORE:
+			os << "\tN::store(c, " << BIT2(op) << ");\n";
+			ends_block = true;
+			break;
+		case OP_LD_LOAD:
+			// Reads wrap at 4KB, as in the interpreter
+			os << "\t{\n\t\tconst BYTE* m = N::memory(c);\n\t\tWORD ir = N::IR(c);\n";
+			for (int i = 0; i <= BIT2(op); ++i)
+				os << "\t\t" << _reg(i) << " = m[(ir + " << i << ") & 0xFFF];\n";
+			os << "\t\tN::IR(c) += " << BIT2(op) + 1 << ";\n\t}\n";
+			break;
+		default:
+			// FX0A and unknown ops stay with the interpreter
+			return false;
+		}
+		os << "\tN::tick(c);\n";
+		if (ends_block) {
+			os << "\treturn " << follow << ";\n";
+			next.push_back(pc + 2);
+		}
+		return true;
+	}
+};
+
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		std::cerr << "Usage: Chip8Recompiler <rom> <output.cpp> [symbol]" << std::endl;
+		return 1;
+	}
+
+	int filesize = 0;
+	LPBYTE buffer = load_application(argv[1], filesize);
+	if (buffer == nullptr || filesize <= 0) return 1;
+
+	std::string rom_name = argv[1];
+	size_t slash = rom_name.find_last_of("/\\");
+	if (slash != std::string::npos) rom_name = rom_name.substr(slash + 1);
+
+	std::string symbol = argc > 3 ? argv[3] : "chip8_native_" + rom_name.substr(0, rom_name.find('.'));
+	for (char& ch : symbol) {
+		if (!isalnum((unsigned char)ch)) ch = '_';
+	}
+
+	Recompiler rc(buffer, filesize);
+	rc.analyze();
+
+	std::ofstream ofs(argv[2]);
+	if (!ofs.is_open()) {
+		std::cerr << "Failed to open " << argv[2] << std::endl;
+		delete[] buffer;
+		return 1;
+	}
+	rc.emit(ofs, symbol, rom_name);
+	ofs.close();
+	delete[] buffer;
+
+	std::cout << rc.block_count() << " blocks written to " << argv[2]
+		<< " as " << symbol << "." << std::endl;
+	return 0;
+}
@@ -16,71 +16,186 @@
 	You should have received a copy of the GNU General Public License
 	along with this program.  If not, see https://www.gnu.org/licenses/
 */
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 #include "Chip8.h"
 
+void* Chip8::operator new(size_t size)
+{
+	// The pointer malloc returned is kept just before the aligned object
+	void* raw = malloc(size + alignof(Chip8) + sizeof(void*));
+	if (raw == nullptr) throw std::bad_alloc();
+	uintptr_t at = ((uintptr_t)raw + sizeof(void*) + alignof(Chip8) - 1) & ~(uintptr_t)(alignof(Chip8) - 1);
+	((void**)at)[-1] = raw;
+	return (void*)at;
+}
+
+void Chip8::operator delete(void* p)
+{
+	if (p != nullptr) free(((void**)p)[-1]);
+}
+
+Chip8::Chip8(const Chip8& other) : Chip8()
+{
+	*this = other;
+}
+
+Chip8& Chip8::operator=(const Chip8& other)
+{
+	if (this == &other) return *this;
+	memcpy(V, other.V, sizeof(V));
+	PC = other.PC;
+	IR = other.IR;
+	SP = other.SP;
+	op = other.op;
+	keys = other.keys;
+	timer_delay = other.timer_delay;
+	timer_sound = other.timer_sound;
+	draw_flag = other.draw_flag;
+	err_flag = other.err_flag;
+	wait_flag = other.wait_flag;
+	quiet = other.quiet;
+	ips = other.ips;
+	timer_acc = other.timer_acc;
+	vblank = other.vblank;
+	rng = other.rng;
+	seed_value = other.seed_value;
+	memcpy(stack, other.stack, sizeof(stack));
+	pristine = other.pristine;
+	fast_forwarded = other.fast_forwarded;
+	memcpy(screen, other.screen, sizeof(screen));
+	memcpy(memory, other.memory, sizeof(memory));
+#ifdef CHIP8_TABLE_DISPATCH
+	memcpy(icache, other.icache, sizeof(icache));
+#endif
+	// Whatever was translated here came from the memory just copied over
+	if (code_cache) code_cache->invalidate(0, sizeof(memory));
+	return *this;
+}
+
 void Chip8::initialize() {
+#ifdef CHIP8_TABLE_DISPATCH
+	static const BOOL table_ready = _build_op_table();
+	(void)table_ready;
+#endif
 	PC = 0x200;
 	IR = 0;
 	SP = 0;
 	memset(memory, 0, sizeof(memory));
 	memset(V, 0, sizeof(V));
 	memset(screen, 0, sizeof(screen));
-	memset(keys, 0, sizeof(keys));
+	keys = 0;
 	memset(stack, 0, sizeof(stack));
-	memset(keymap, 0, sizeof(keymap));
 	memcpy(memory, chip8_fontset, 80);
+	_memory_written(0, sizeof(memory));
 	timer_delay = timer_sound = 0;
+	timer_acc = 0;
 	draw_flag = true;
 	err_flag = false;
-	srand(time(NULL)); // prepare for the random instruction
-
-	keymap['1'] = 0x1;
-	keymap['2'] = 0x2;
-	keymap['3'] = 0x3;
-	keymap['4'] = 0xC;
-
-	keymap['q'] = keymap['Q'] = 0x4;
-	keymap['w'] = keymap['W'] = 0x5;
-	keymap['e'] = keymap['E'] = 0x6;
-	keymap['r'] = keymap['R'] = 0xD;
-
-	keymap['a'] = keymap['A'] = 0x7;
-	keymap['s'] = keymap['S'] = 0x8;
-	keymap['d'] = keymap['D'] = 0x9;
-	keymap['f'] = keymap['F'] = 0xE;
-
-	keymap['z'] = keymap['Z'] = 0xA;
-	keymap['x'] = keymap['X'] = 0x0;
-	keymap['c'] = keymap['C'] = 0xB;
-	keymap['v'] = keymap['V'] = 0xF;
+	rng = chip8_rng_seed(seed_value);
+	pristine.reset();
 }
 
 void Chip8::load_code(const LPBYTE code_buffer, const size_t buffer_size) {
 	memcpy(memory + 0x200, code_buffer, buffer_size);
+	_memory_written(0x200, (WORD)buffer_size);
+	// A new image, chips started from the old one keep it
+	std::shared_ptr<Chip8State> image = std::make_shared<Chip8State>();
+	save_state(*image);
+	pristine = image;
+}
+
+BOOL Chip8::load_image(std::shared_ptr<const Chip8State> image)
+{
+	if (!image || image->magic != Chip8State::MAGIC || image->version != Chip8State::VERSION)
+		return false;
+	pristine = std::move(image);
+	reset();
+	return true;
 }
 
 void Chip8::reset()
 {
-	PC = 0x200;
-	IR = 0;
-	SP = 0;
-	memset(V, 0, sizeof(V));
-	memset(screen, 0, sizeof(screen));
-	memset(keys, 0, sizeof(keys));
-	memset(stack, 0, sizeof(stack));
-	memset(keymap, 0, sizeof(keymap));
-	memcpy(memory, chip8_fontset, 80);
-	timer_delay = timer_sound = 0;
+	if (!pristine) {
+		// Nothing loaded yet
+		initialize();
+		return;
+	}
+	DWORD rate = ips;
+	uint64_t from = seed_value;
+	load_state(*pristine);
+	ips = rate;
+	timer_acc = 0;
+	seed_value = from;
+	rng = chip8_rng_seed(from);
+}
+
+void Chip8::save_state(Chip8State& state) const
+{
+	state.magic = Chip8State::MAGIC;
+	state.version = Chip8State::VERSION;
+	memcpy(state.V, V, sizeof(V));
+	state.pc = PC;
+	state.ir = IR;
+	state.sp = SP;
+	state.keys = keys;
+	memcpy(state.stack, stack, sizeof(stack));
+	state.delay = timer_delay;
+	state.sound = timer_sound;
+	state.flags = (err_flag ? Chip8State::ERR : 0) | (wait_flag ? Chip8State::WAIT : 0);
+	state.pad = 0;
+	state.ips = ips;
+	state.timer_acc = timer_acc;
+	state.vblank = vblank;
+	state.rng = rng;
+	state.seed = seed_value;
+	memcpy(state.screen, screen, sizeof(screen));
+	memcpy(state.memory, memory, sizeof(memory));
+}
+
+BOOL Chip8::load_state(const Chip8State& state)
+{
+	if (state.magic != Chip8State::MAGIC || state.version != Chip8State::VERSION) return false;
+
+	memcpy(V, state.V, sizeof(V));
+	PC = state.pc;
+	IR = state.ir;
+	SP = state.sp;
+	keys = state.keys;
+	memcpy(stack, state.stack, sizeof(stack));
+	timer_delay = state.delay;
+	timer_sound = state.sound;
+	err_flag = (state.flags & Chip8State::ERR) != 0;
+	wait_flag = (state.flags & Chip8State::WAIT) != 0;
 	draw_flag = true;
-	err_flag = false;
-	srand(time(NULL));
+	ips = state.ips > 0 ? state.ips : 1;
+	timer_acc = state.timer_acc % ips;
+	vblank = state.vblank;
+	rng = state.rng != 0 ? state.rng : chip8_rng_seed(state.seed);
+	seed_value = state.seed;
+	memcpy(screen, state.screen, sizeof(screen));
+	for (WORD block = 0; block < sizeof(memory); block += 64) {
+		if (memcmp(memory + block, state.memory + block, 64) == 0) continue;
+		memcpy(memory + block, state.memory + block, 64);
+		_memory_written(block, 64);
+	}
+	return true;
 }
 
 void Chip8::emulate_cycle()
 {
 	draw_flag = false;
-	op = memory[PC] << 8 | memory[PC + 1];
+	wait_flag = false;
+#ifdef CHIP8_TABLE_DISPATCH
+	const Instr& in = icache[PC & 0xFFF];
+	if (in.fn == nullptr) _decode(PC & 0xFFF);
+	if (chip8_profiling) chip8_profile.count(chip8_op_kind(in.op), *this, PC, SP);
+	(this->*in.fn)(in);
+#else
+	op = memory[PC & 0xFFF] << 8 | memory[(PC + 1) & 0xFFF];
+	if (chip8_profiling) chip8_profile.count(chip8_op_kind(op), *this, PC, SP);
 	switch (op & 0xF000)
 	{
 	case 0x0000:  // IR just ignored the 0x0NNN op
@@ -91,7 +206,7 @@ void Chip8::emulate_cycle()
 			draw_flag = true;
 			break;
 		case 0x000E: // 0x00EE subroutine return
-			PC = stack[--SP]; // remember that sp refers to above the top
+			PC = stack[--SP & 15]; // remember that sp refers to above the top
 			break;
 		default:
 			_error_op(0x0000);
@@ -103,23 +218,23 @@ void Chip8::emulate_cycle()
 		PC = op & 0x0FFF; // we shouldn't add 2 to PC here		
 		break;
 	case 0x2000: // Call subroutine
-		stack[SP++] = PC;
+		stack[SP++ & 15] = PC;
 		PC = op & 0x0FFF;
 		break;
 	case 0x3000: // skip the next inst if V[X] == NN
-		if (V[BIT2(op)] == (op & 0x00FF)) {
+		if (chip8_profile.skip(OP_SE_IMM, V[BIT2(op)] == (op & 0x00FF))) {
 			PC += 2;
 		}
 		PC += 2;
 		break;
 	case 0x4000: // just contrary to the last op
-		if (V[BIT2(op)] != (op & 0x00FF)) {
+		if (chip8_profile.skip(OP_SNE_IMM, V[BIT2(op)] != (op & 0x00FF))) {
 			PC += 2;
 		}
 		PC += 2;
 		break;
 	case 0x5000:
-		if (V[BIT2(op)] == V[BIT1(op)]) {
+		if (chip8_profile.skip(OP_SE_REG, V[BIT2(op)] == V[BIT1(op)])) {
 			PC += 2;
 		}
 		PC += 2;
@@ -191,7 +306,7 @@ void Chip8::emulate_cycle()
 		}
 		break;
 	case 0x9000:
-		if (V[BIT2(op)] != V[BIT1(op)]) {
+		if (chip8_profile.skip(OP_SNE_REG, V[BIT2(op)] != V[BIT1(op)])) {
 			PC += 2;
 		}
 		PC += 2;
@@ -204,42 +319,25 @@ void Chip8::emulate_cycle()
 		PC = (op & 0x0FFF) + V[0];
 		break;
 	case 0xC000:
-		V[BIT2(op)] = (rand() % 0xFF) & (op & 0x00FF);
+		V[BIT2(op)] = chip8_rng_next(rng) & (op & 0x00FF);
 		PC += 2;
 		break;
-	case 0xD000: {
-		WORD x = V[BIT2(op)];
-		WORD y = V[BIT1(op)];
-		WORD h = BIT0(op);
-		WORD pix;
-
-		V[0xF] = 0;
-		for (int i = 0; i < h; ++i) {
-			pix = memory[IR + i];
-			for (int j = 0; j < 8; ++j) {
-				if (pix & (0x80 >> j)) { // check the status of each bit
-					if (screen[x + j][y + i] == 1)
-						V[0xF] = 1;
-					screen[x + j][y + i] ^= 1;
-				}
-			}
-		}
-		draw_flag = true;
+	case 0xD000:
+		_draw_sprite(V[BIT2(op)], V[BIT1(op)], BIT0(op));
 		PC += 2;
 		break;
-	}
 	case 0xE000:
 		switch (op & 0x00FF) // note that here is the last two bits
 		{
 		case 0x009E: // EX9E: Skips the next instruction if the key stored in VX is pressed
-			if (keys[V[BIT2(op)]] != 0) {
+			if (chip8_profile.skip(OP_SKP, _key_down(V[BIT2(op)]) != 0)) {
 				PC += 2;
 			}
 			PC += 2;
 			break;
 
 		case 0x00A1: // EXA1: Skips the next instruction if the key stored in VX isn't pressed
-			if (keys[V[BIT2(op)]] == 0) {
+			if (chip8_profile.skip(OP_SKNP, !_key_down(V[BIT2(op)]))) {
 				PC += 2;
 			}
 			PC += 2;
@@ -262,7 +360,7 @@ void Chip8::emulate_cycle()
 			BOOL keyPress = false;
 			for (int i = 0; i < 16; ++i)
 			{
-				if (keys[i] != 0)
+				if (_key_down(i))
 				{
 					V[BIT2(op)] = i;
 					keyPress = true;
@@ -270,7 +368,10 @@ void Chip8::emulate_cycle()
 			}
 			// If we didn't received a keypress, skip this cycle and try again.
 			//(Blocking Operation. All instruction halted until next key event)
-			if (!keyPress) return;
+			if (!keyPress) {
+				wait_flag = true;
+				break;
+			}
 			PC += 2;
 			break;
 		}
@@ -300,23 +401,18 @@ void Chip8::emulate_cycle()
 			break;
 
 		case 0x0033: // FX33: Stores the Binary-coded decimal representation of VX at the addresses IR, IR plus 1, and IR plus 2
-			memory[IR] = V[BIT2(op)] / 100;
-			memory[IR + 1] = (V[BIT2(op)] / 10) % 10;
-			memory[IR + 2] = (V[BIT2(op)] % 100) % 10;
+			_store_bcd(V[BIT2(op)]);
 			PC += 2;
 			break;
 
 		case 0x0055: // FX55: Stores V0 to VX in memory starting at address IR					
-			for (int i = 0; i <= (BIT2(op)); ++i)
-				memory[IR + i] = V[i];
-			// On the original interpreter, when the operation is done, IR = IR + X + 1.
-			IR += (BIT2(op)) + 1;
+			_store_regs(BIT2(op));
 			PC += 2;
 			break;
 
 		case 0x0065: // FX65: Fills V0 to VX with values from memory starting at address IR					
 			for (int i = 0; i <= (BIT2(op)); ++i)
-				V[i] = memory[IR + i];
+				V[i] = memory[(IR + i) & 0xFFF];
 			// On the original interpreter, when the operation is done, IR = IR + X + 1.
 			IR += (BIT2(op)) + 1;
 			PC += 2;
@@ -330,18 +426,595 @@ void Chip8::emulate_cycle()
 		_error_op(0xCAFE);
 		break;
 	}
+#endif
+
+	if (wait_flag) {
+		// FX0A halts the timers as well
+		chip8_profile.stall(PC);
+		return;
+	}
+	if (err_flag) return; // As in run_cycles, the chip stops before the timers tick
+
+	_tick_timers();
+}
+
+RunResult Chip8::run_frame(DWORD* executed)
+{
+	BOOL drawn = false;
+	DWORD total = 0;
+	DWORD frame = vblank;
+	while (vblank == frame && !err_flag) {
+		DWORD done = 0;
+		RunResult result = run_cycles(cycles_to_vblank(), &done);
+		total += done;
+		if (result == RUN_DRAW) drawn = true;
+		if (result == RUN_KEY_WAIT) {
+			// The timers keep counting while FX0A waits
+			idle(cycles_to_vblank());
+		}
+	}
+	if (executed) *executed = total;
+	return err_flag ? RUN_ERROR : drawn ? RUN_DRAW : wait_flag ? RUN_KEY_WAIT : RUN_BUDGET;
+}
+
+OpKind chip8_op_kind(WORD op)
+{
+	// Mirrors the decoding of the switch in Chip8::emulate_cycle
+	switch (op & 0xF000)
+	{
+	case 0x0000:
+		switch (op & 0x000F)
+		{
+		case 0x0000: return OP_CLS;
+		case 0x000E: return OP_RET;
+		default:     return OP_BAD;
+		}
+	case 0x1000: return OP_JP;
+	case 0x2000: return OP_CALL;
+	case 0x3000: return OP_SE_IMM;
+	case 0x4000: return OP_SNE_IMM;
+	case 0x5000: return OP_SE_REG;
+	case 0x6000: return OP_LD_IMM;
+	case 0x7000: return OP_ADD_IMM;
+	case 0x8000:
+		switch (op & 0x000F)
+		{
+		case 0x0: return OP_LD_REG;
+		case 0x1: return OP_OR;
+		case 0x2: return OP_AND;
+		case 0x3: return OP_XOR;
+		case 0x4: return OP_ADD_REG;
+		case 0x5: return OP_SUB;
+		case 0x6: return OP_SHR;
+		case 0x7: return OP_SUBN;
+		case 0xE: return OP_SHL;
+		default:  return OP_BAD;
+		}
+	case 0x9000: return OP_SNE_REG;
+	case 0xA000: return OP_LD_I;
+	case 0xB000: return OP_JP_V0;
+	case 0xC000: return OP_RND;
+	case 0xD000: return OP_DRW;
+	case 0xE000:
+		switch (op & 0x00FF)
+		{
+		case 0x009E: return OP_SKP;
+		case 0x00A1: return OP_SKNP;
+		default:     return OP_BAD;
+		}
+	default: // 0xF000
+		switch (op & 0x00FF)
+		{
+		case 0x0007: return OP_LD_VX_DT;
+		case 0x000A: return OP_LD_KEY;
+		case 0x0015: return OP_LD_DT;
+		case 0x0018: return OP_LD_ST;
+		case 0x001E: return OP_ADD_I;
+		case 0x0029: return OP_LD_F;
+		case 0x0033: return OP_LD_BCD;
+		case 0x0055: return OP_LD_STORE;
+		case 0x0065: return OP_LD_LOAD;
+		default:     return OP_BAD;
+		}
+	}
+}
+
+const char* chip8_op_name(OpKind kind)
+{
+	static const char* const names[OP_KINDS + 1] = {
+		"00E0", "00EE", "1NNN", "2NNN",
+		"3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+		"8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7", "8XYE",
+		"9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1",
+		"FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29",
+		"FX33", "FX55", "FX65",
+		"bad",
+		"?"
+	};
+	return names[kind < OP_KINDS ? kind : OP_KINDS];
+}
+
+thread_local OpProfile<chip8_profiling> chip8_profile;
+
+template <>
+uint64_t OpProfile<true>::total() const
+{
+	uint64_t sum = fast_forwarded;
+	for (int k = 0; k < OP_KINDS; ++k) sum += ops[k];
+	return sum;
+}
+
+template <>
+void OpProfile<true>::clear()
+{
+	memset(ops, 0, sizeof(ops));
+	memset(taken, 0, sizeof(taken));
+	memset(hits, 0, sizeof(hits));
+	fast_forwarded = 0;
+	since_sample = 0;
+	stacks.clear();
+}
+
+template <>
+void OpProfile<true>::merge(const OpProfile<true>& other)
+{
+	for (int k = 0; k < OP_KINDS; ++k) {
+		ops[k] += other.ops[k];
+		taken[k] += other.taken[k];
+	}
+	for (int a = 0; a < 4096; ++a)
+		hits[a] += other.hits[a];
+	fast_forwarded += other.fast_forwarded;
+	for (const auto& s : other.stacks)
+		stacks[s.first] += s.second;
+}
+
+template <>
+void OpProfile<true>::_sample(const Chip8& chip, WORD pc, WORD sp)
+{
+	since_sample = 0;
+	// Deeper calls than 16 have overwritten the outermost entries
+	int depth = sp < 16 ? sp : 16;
+	std::vector<WORD> key;
+	key.reserve(depth + 1);
+	for (int i = sp - depth; i < sp; ++i)
+		key.push_back(chip.get_stack(i));
+	key.push_back(pc & 0xFFF);
+	++stacks[key];
+}
+
+namespace {
+	struct ProfileBlock {
+		WORD start, end;        // end is one past the last instruction
+		uint64_t runs;          // times the first instruction ran
+		uint64_t instructions;
+	};
+
+	WORD profile_op(const Chip8& chip, WORD addr)
+	{
+		return chip.peek(addr) << 8 | chip.peek(addr + 1);
+	}
+
+	// Basic blocks of the code that ran, in address order. A block ends after a
+	// jump, call, return or skip, and where the next address ran a different
+	// number of times, which is where a jump lands or a skip jumps over
+	std::vector<ProfileBlock> profile_blocks(const uint64_t* hits, const Chip8& chip)
+	{
+		std::vector<ProfileBlock> blocks;
+		int pc = 0;
+		while (pc < 4096) {
+			if (hits[pc] == 0) {
+				++pc;
+				continue;
+			}
+			ProfileBlock block = { (WORD)pc, (WORD)pc, hits[pc], 0 };
+			for (;;) {
+				block.instructions += hits[pc];
+				OpKind kind = chip8_op_kind(profile_op(chip, (WORD)pc));
+				pc += 2;
+				BOOL branch = kind == OP_JP || kind == OP_CALL || kind == OP_RET || kind == OP_JP_V0
+					|| kind == OP_SE_IMM || kind == OP_SNE_IMM || kind == OP_SE_REG || kind == OP_SNE_REG
+					|| kind == OP_SKP || kind == OP_SKNP || kind == OP_BAD;
+				if (branch || pc >= 4096 || hits[pc] != block.runs) break;
+			}
+			block.end = (WORD)pc;
+			blocks.push_back(block);
+		}
+		return blocks;
+	}
+}
+
+template <>
+void OpProfile<true>::report(FILE* out, const Chip8& chip) const
+{
+	std::vector<ProfileBlock> blocks = profile_blocks(hits, chip);
+	uint64_t sum = 0;
+	for (const ProfileBlock& b : blocks) sum += b.instructions;
+	std::sort(blocks.begin(), blocks.end(),
+		[](const ProfileBlock& a, const ProfileBlock& b) { return a.instructions > b.instructions; });
+
+	fprintf(out, "Hot blocks: %u of them ran, the 20 busiest\n", (unsigned)blocks.size());
+	fprintf(out, "  start  end    instructions   share          runs  first op\n");
+	for (size_t i = 0; i < blocks.size() && i < 20; ++i) {
+		const ProfileBlock& b = blocks[i];
+		fprintf(out, "  %03X    %03X  %14llu %6.2f%% %13llu  %04X\n", b.start, b.end - 2,
+			(unsigned long long)b.instructions, 100.0 * b.instructions / sum,
+			(unsigned long long)b.runs, profile_op(chip, b.start));
+	}
+}
+
+template <>
+void OpProfile<true>::write_stacks(FILE* out, const Chip8& chip) const
+{
+	// Frames are named after the subroutine a 2NNN on the stack called, the leaf
+	// after the block the PC was in. Counts are scaled back up to instructions
+	std::vector<ProfileBlock> blocks = profile_blocks(hits, chip);
+	std::map<std::string, uint64_t> lines;
+	char name[16];
+	for (const auto& sample : stacks) {
+		const std::vector<WORD>& key = sample.first;
+		std::string line = "main";
+		for (size_t i = 0; i + 1 < key.size(); ++i) {
+			WORD call = profile_op(chip, key[i]);
+			if ((call & 0xF000) == 0x2000) snprintf(name, sizeof(name), ";sub_%03X", ADDR(call));
+			else snprintf(name, sizeof(name), ";call_%03X", key[i]);
+			line += name;
+		}
+		WORD pc = key.back();
+		auto in = std::upper_bound(blocks.begin(), blocks.end(), pc,
+			[](WORD addr, const ProfileBlock& b) { return addr < b.start; });
+		if (in != blocks.begin() && pc < (in - 1)->end) snprintf(name, sizeof(name), ";blk_%03X", (in - 1)->start);
+		else snprintf(name, sizeof(name), ";pc_%03X", pc);
+		line += name;
+		lines[line] += sample.second * SAMPLE_EVERY;
+	}
+	for (const auto& line : lines)
+		fprintf(out, "%s %llu\n", line.first.c_str(), (unsigned long long)line.second);
+}
+
+template <>
+void OpProfile<true>::dump(FILE* out) const
+{
+	// Most executed first, with the share of skips that skipped
+	int order[OP_KINDS];
+	for (int k = 0; k < OP_KINDS; ++k) order[k] = k;
+	std::sort(order, order + OP_KINDS, [this](int a, int b) { return ops[a] > ops[b]; });
+
+	uint64_t sum = total();
+	fprintf(out, "Opcode profile: %llu instructions, %llu of them in fast-forwarded delay waits\n",
+		(unsigned long long)sum, (unsigned long long)fast_forwarded);
+	for (int i = 0; i < OP_KINDS && ops[order[i]] > 0; ++i) {
+		int k = order[i];
+		fprintf(out, "  %-4s %14llu %6.2f%%", chip8_op_name((OpKind)k),
+			(unsigned long long)ops[k], 100.0 * ops[k] / sum);
+		if (taken[k] > 0 || k == OP_SE_IMM || k == OP_SNE_IMM || k == OP_SE_REG
+			|| k == OP_SNE_REG || k == OP_SKP || k == OP_SKNP) {
+			fprintf(out, "   skipped %6.2f%%", 100.0 * taken[k] / ops[k]);
+		}
+		fprintf(out, "\n");
+	}
+}
+
+void Chip8::_draw_sprite(BYTE vx, BYTE vy, BYTE h)
+{
+	// A sprite row is one byte, line it up with the leftmost pixel and rotate it
+	// into place, so whatever falls off the right edge wraps around to the left
+	int x = vx & 63;
+	int y = vy & 31;
+	BYTE hit = 0;
+
+	for (int i = 0; i < h; ++i) {
+		uint64_t row = (uint64_t)memory[(IR + i) & 0xFFF] << 56;
+		row = (row >> x) | (row << ((64 - x) & 63));
+		uint64_t& line = screen[(y + i) & 31];
+		hit |= (line & row) != 0;
+		line ^= row;
+	}
+	V[0xF] = hit;
+	draw_flag = true;
+}
+
+void Chip8::_store_bcd(BYTE value)
+{
+	// IR can be anywhere after FX1E, the writes wrap at 4KB like the reads
+	memory[IR & 0xFFF] = value / 100;
+	memory[(IR + 1) & 0xFFF] = (value / 10) % 10;
+	memory[(IR + 2) & 0xFFF] = (value % 100) % 10;
+	_memory_written(IR, 3);
+}
+
+void Chip8::_store_regs(BYTE x)
+{
+	for (int i = 0; i <= x; ++i)
+		memory[(IR + i) & 0xFFF] = V[i];
+	_memory_written(IR, x + 1);
+	// On the original interpreter, when the operation is done, IR = IR + X + 1.
+	IR += x + 1;
+}
+
+void Chip8::_memory_written(WORD addr, WORD len)
+{
+	// Drop everything decoded or translated from these bytes, split where they wrap
+	addr &= 0xFFF;
+	if (addr + len > 0x1000) {
+		_memory_written(0, addr + len - 0x1000);
+		len = 0x1000 - addr;
+	}
+#ifdef CHIP8_TABLE_DISPATCH
+	_invalidate(addr, len);
+#endif
+	if (code_cache) code_cache->invalidate(addr, len);
+}
+
+DWORD Chip8::_skip_delay_loop(WORD pc, DWORD room)
+{
+	// FX07; 3X00; 1NNN back to the FX07 spins until the delay timer is zero
+	if (timer_delay == 0 || pc > 0xFFA) return 0;
+	WORD read = memory[pc] << 8 | memory[pc + 1];
+	if ((read & 0xF0FF) != 0xF007) return 0;
+	if ((memory[pc + 2] << 8 | memory[pc + 3]) != (0x3000 | (read & 0x0F00))) return 0;
+	if ((memory[pc + 4] << 8 | memory[pc + 5]) != (0x1000 | pc)) return 0;
+
+	// Each turn is 3 instructions, find how many it takes for the timer to run out
+	uint64_t turns = ((uint64_t)timer_delay * ips - timer_acc + 179) / 180;
+	if (turns > room / 3) turns = room / 3;
+	_advance_timers((DWORD)turns * 3);
+	fast_forwarded += turns * 3;
+	chip8_profile.fast_forward((DWORD)turns * 3);
+	return (DWORD)turns * 3;
+}
+
+#ifdef CHIP8_TABLE_DISPATCH
+//----------------------------------- Table dispatched handlers -----------------------------------
+
+Chip8::Handler Chip8::op_table[16][256];
+
+BOOL Chip8::_build_op_table()
+{
+	static const Handler handlers[OP_KINDS] = {
+		&Chip8::_op_cls, &Chip8::_op_ret, &Chip8::_op_jp, &Chip8::_op_call,
+		&Chip8::_op_se_imm, &Chip8::_op_sne_imm, &Chip8::_op_se_reg, &Chip8::_op_ld_imm, &Chip8::_op_add_imm,
+		&Chip8::_op_ld_reg, &Chip8::_op_or, &Chip8::_op_and, &Chip8::_op_xor,
+		&Chip8::_op_add_reg, &Chip8::_op_sub, &Chip8::_op_shr, &Chip8::_op_subn, &Chip8::_op_shl,
+		&Chip8::_op_sne_reg, &Chip8::_op_ld_i, &Chip8::_op_jp_v0, &Chip8::_op_rnd,
+		&Chip8::_op_drw, &Chip8::_op_skp, &Chip8::_op_sknp,
+		&Chip8::_op_ld_vx_dt, &Chip8::_op_ld_key, &Chip8::_op_ld_dt, &Chip8::_op_ld_st,
+		&Chip8::_op_add_i, &Chip8::_op_ld_f,
+		&Chip8::_op_ld_bcd, &Chip8::_op_ld_store, &Chip8::_op_ld_load,
+		&Chip8::_op_bad
+	};
+
+	for (int hi = 0; hi < 16; ++hi)
+		for (int lo = 0; lo < 256; ++lo)
+			op_table[hi][lo] = handlers[chip8_op_kind(hi << 12 | lo)];
+	return true;
+}
+
+void Chip8::_decode(WORD addr)
+{
+	Instr& in = icache[addr];
+	in.op = memory[addr] << 8 | memory[(addr + 1) & 0xFFF];
+	in.nnn = ADDR(in.op);
+	in.nn = LOW8(in.op);
+	in.x = BIT2(in.op);
+	in.y = BIT1(in.op);
+	in.n = BIT0(in.op);
+	in.fn = op_table[in.op >> 12][in.nn];
+}
+
+void Chip8::_invalidate(WORD addr, WORD len)
+{
+	// An entry decodes memory[a] and memory[a + 1], so the byte before is stale too
+	for (int a = addr - 1; a < addr + len; ++a)
+		icache[a & 0xFFF].fn = nullptr;
+}
+
+RunResult Chip8::run_cycles(DWORD budget, DWORD* executed)
+{
+	// emulate_cycle in a loop, stopping where the threaded core in Chip8Threaded.cpp
+	// stops. A batched copy of the handler loop measured no faster than this
+	DWORD done = 0;
+	draw_flag = false;
+	wait_flag = false;
+	while (done < budget) {
+		if (timer_delay != 0)
+			done += _skip_delay_loop(PC, budget - done - 1);
+		emulate_cycle();
+		if (wait_flag) break; // Not executed until a key is down
+		++done;
+		if (err_flag || draw_flag) break;
+	}
+	if (executed) *executed = done;
+	return run_result();
+}
+
+void Chip8::_op_cls(const Instr&) {
+	_clear_screen();
+	draw_flag = true;
+	PC += 2;
+}
+
+void Chip8::_op_ret(const Instr&) {
+	PC = stack[--SP & 15] + 2;
+}
+
+void Chip8::_op_jp(const Instr& in) {
+	PC = in.nnn;
+}
+
+void Chip8::_op_call(const Instr& in) {
+	stack[SP++ & 15] = PC;
+	PC = in.nnn;
+}
+
+void Chip8::_op_se_imm(const Instr& in) {
+	PC += chip8_profile.skip(OP_SE_IMM, V[in.x] == in.nn) ? 4 : 2;
+}
+
+void Chip8::_op_sne_imm(const Instr& in) {
+	PC += chip8_profile.skip(OP_SNE_IMM, V[in.x] != in.nn) ? 4 : 2;
+}
+
+void Chip8::_op_se_reg(const Instr& in) {
+	PC += chip8_profile.skip(OP_SE_REG, V[in.x] == V[in.y]) ? 4 : 2;
+}
+
+void Chip8::_op_ld_imm(const Instr& in) {
+	V[in.x] = in.nn;
+	PC += 2;
+}
+
+void Chip8::_op_add_imm(const Instr& in) {
+	V[in.x] += in.nn;
+	PC += 2;
+}
+
+void Chip8::_op_ld_reg(const Instr& in) {
+	V[in.x] = V[in.y];
+	PC += 2;
+}
+
+void Chip8::_op_or(const Instr& in) {
+	V[in.x] |= V[in.y];
+	PC += 2;
+}
+
+void Chip8::_op_and(const Instr& in) {
+	V[in.x] &= V[in.y];
+	PC += 2;
+}
+
+void Chip8::_op_xor(const Instr& in) {
+	V[in.x] ^= V[in.y];
+	PC += 2;
+}
+
+void Chip8::_op_add_reg(const Instr& in) {
+	BYTE x = in.x, y = in.y;
+	V[0xF] = V[y] > (0xFF - V[x]); // overflow, so set CF
+	V[x] += V[y];
+	PC += 2;
+}
+
+void Chip8::_op_sub(const Instr& in) {
+	BYTE x = in.x, y = in.y;
+	V[0xF] = V[y] <= V[x];
+	V[x] -= V[y];
+	PC += 2;
+}
+
+void Chip8::_op_shr(const Instr& in) {
+	BYTE x = in.x;
+	V[0xF] = V[x] & 0x1;
+	V[x] >>= 1;
+	PC += 2;
+}
 
-	if (timer_delay > 0) timer_delay--;
-	if (timer_sound > 0) {
-		if (timer_sound == 1) {
-			_beep();
+void Chip8::_op_subn(const Instr& in) {
+	BYTE x = in.x, y = in.y;
+	V[0xF] = V[x] <= V[y];
+	V[x] = V[y] - V[x];
+	PC += 2;
+}
+
+void Chip8::_op_shl(const Instr& in) {
+	BYTE x = in.x;
+	V[0xF] = V[x] >> 7;
+	V[x] <<= 1;
+	PC += 2;
+}
+
+void Chip8::_op_sne_reg(const Instr& in) {
+	PC += chip8_profile.skip(OP_SNE_REG, V[in.x] != V[in.y]) ? 4 : 2;
+}
+
+void Chip8::_op_ld_i(const Instr& in) {
+	IR = in.nnn;
+	PC += 2;
+}
+
+void Chip8::_op_jp_v0(const Instr& in) {
+	PC = in.nnn + V[0];
+}
+
+void Chip8::_op_rnd(const Instr& in) {
+	V[in.x] = chip8_rng_next(rng) & in.nn;
+	PC += 2;
+}
+
+void Chip8::_op_drw(const Instr& in) {
+	_draw_sprite(V[in.x], V[in.y], in.n);
+	PC += 2;
+}
+
+void Chip8::_op_skp(const Instr& in) {
+	PC += chip8_profile.skip(OP_SKP, _key_down(V[in.x]) != 0) ? 4 : 2;
+}
+
+void Chip8::_op_sknp(const Instr& in) {
+	PC += chip8_profile.skip(OP_SKNP, !_key_down(V[in.x])) ? 4 : 2;
+}
+
+void Chip8::_op_ld_vx_dt(const Instr& in) {
+	V[in.x] = timer_delay;
+	PC += 2;
+}
+
+void Chip8::_op_ld_key(const Instr& in) {
+	wait_flag = true;
+	for (int i = 0; i < 16; ++i) {
+		if (_key_down(i)) {
+			V[in.x] = i;
+			wait_flag = false;
 		}
-		timer_sound--;
 	}
+	if (!wait_flag) PC += 2;
+}
+
+void Chip8::_op_ld_dt(const Instr& in) {
+	timer_delay = V[in.x];
+	PC += 2;
+}
+
+void Chip8::_op_ld_st(const Instr& in) {
+	timer_sound = V[in.x];
+	PC += 2;
+}
+
+void Chip8::_op_add_i(const Instr& in) {
+	BYTE x = in.x;
+	V[0xF] = IR + V[x] > 0xFFF;	// VF is set to 1 when range overflow
+	IR += V[x];
+	PC += 2;
+}
+
+void Chip8::_op_ld_f(const Instr& in) {
+	IR = V[in.x] * 0x5;
+	PC += 2;
+}
+
+void Chip8::_op_ld_bcd(const Instr& in) {
+	_store_bcd(V[in.x]);
+	PC += 2;
+}
+
+void Chip8::_op_ld_store(const Instr& in) {
+	_store_regs(in.x);
+	PC += 2;
+}
+
+void Chip8::_op_ld_load(const Instr& in) {
+	BYTE x = in.x;
+	for (int i = 0; i <= x; ++i)
+		V[i] = memory[(IR + i) & 0xFFF];
+	IR += x + 1;
+	PC += 2;
 }
+#endif
 
 LPBYTE load_application(const std::string& filename, int & filesize) {
-	std::cout << "Loading: " << filename << "..." << std::endl;
+	// Progress goes to stderr with the errors, leaving stdout to the tools' results
+	std::clog << "Loading: " << filename << "..." << std::endl;
 	std::ifstream ifs;
 	ifs.open(filename, std::ios::binary | std::ios::in);
 	if (!ifs.is_open()) {
@@ -350,7 +1023,7 @@ LPBYTE load_application(const std::string& filename, int & filesize) {
 	}
 	ifs.seekg(0, std::ios::end);
 	filesize = ifs.tellg();
-	std::cout << "File size: " << filesize << std::endl;
+	std::clog << "File size: " << filesize << std::endl;
 	ifs.seekg(0, std::ios::beg);
 	LPBYTE buffer = new BYTE[filesize];
 	if (buffer == nullptr) {
@@ -367,6 +1040,6 @@ LPBYTE load_application(const std::string& filename, int & filesize) {
 		std::cerr << "Error: ROM too large for memory." << std::endl;
 		return nullptr;
 	}
-	std::cout << "ROM loaded." << std::endl;
+	std::clog << "ROM loaded." << std::endl;
 	return buffer;
 }
\ No newline at end of file
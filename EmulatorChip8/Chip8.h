@@ -18,15 +18,34 @@
 */
 #pragma once
 
-#include <windows.h>
-
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <fstream>
+#include <map>
 #include <string>
+#include <vector>
+
+// The same types windows.h declares, so the core builds without it.
+// Repeating an identical typedef is fine when windows.h is included too.
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned long DWORD;
+typedef int BOOL;
+typedef BYTE* LPBYTE;
 
 #define BIT0(op) (op & 0x000F)
 #define BIT1(op) ((op & 0x00F0) >> 4)
 #define BIT2(op) ((op & 0x0F00) >> 8)
+#define LOW8(op) (op & 0x00FF)
+#define ADDR(op) (op & 0x0FFF)
+
+// Instruction dispatcher, chosen at build time:
+//   default               - the nested switch in emulate_cycle
+//   CHIP8_TABLE_DISPATCH  - one indirect call through a 16 x 256 handler table,
+//                           indexed by the high nibble and the low byte of op
 
 static BYTE chip8_fontset[80] 
 {
@@ -50,72 +69,415 @@ static BYTE chip8_fontset[80]
 
 LPBYTE load_application(const std::string& filename, int& filesize);
 
-class Chip8 {
+// Instruction classes, shared by the dispatchers that decode ahead of time
+enum OpKind {
+	OP_CLS, OP_RET, OP_JP, OP_CALL,
+	OP_SE_IMM, OP_SNE_IMM, OP_SE_REG, OP_LD_IMM, OP_ADD_IMM,
+	OP_LD_REG, OP_OR, OP_AND, OP_XOR, OP_ADD_REG, OP_SUB, OP_SHR, OP_SUBN, OP_SHL,
+	OP_SNE_REG, OP_LD_I, OP_JP_V0, OP_RND, OP_DRW, OP_SKP, OP_SKNP,
+	OP_LD_VX_DT, OP_LD_KEY, OP_LD_DT, OP_LD_ST, OP_ADD_I, OP_LD_F,
+	OP_LD_BCD, OP_LD_STORE, OP_LD_LOAD,
+	OP_BAD,
+	OP_KINDS
+};
+
+OpKind chip8_op_kind(WORD op);
+const char* chip8_op_name(OpKind kind); // "00E0", "DXYN", "8XY4", ...
+
+// Per-opcode execution counts, for telling which dispatch and fusion work pays
+// off on a set of ROMs, and a heatmap of where in memory the time goes. Only
+// builds with CHIP8_PROFILE defined count anything: otherwise chip8_profile is
+// the empty OpProfile<false>, whose calls are no-ops the compiler drops, so the
+// interpreter stays as it was.
+// emulate_cycle and run_cycles count into the object of the thread running
+// them; tools running chips on several threads merge() them at the end. The
+// JIT and native code are not counted.
+#ifdef CHIP8_PROFILE
+constexpr bool chip8_profiling = true;
+#else
+constexpr bool chip8_profiling = false;
+#endif
+
+class Chip8;
+
+template <bool Enabled>
+struct OpProfile {
+	uint64_t ops[OP_KINDS];
+	uint64_t taken[OP_KINDS];   // skips that skipped, for 3XNN 4XNN 5XY0 9XY0 EX9E EXA1
+	uint64_t fast_forwarded;    // instructions of delay timer busy waits done in one step
+	uint64_t hits[4096];        // instructions run at each address
+
+	// Every SAMPLE_EVERY instructions the call stack is recorded: the address
+	// of each 2NNN still on Chip8::stack, outermost first, then the PC
+	enum { SAMPLE_EVERY = 97 };
+	DWORD since_sample;
+	std::map<std::vector<WORD>, uint64_t> stacks;
+	bool paused;
+
+	void count(OpKind kind, const Chip8& chip, WORD pc, WORD sp) {
+		if (paused) return;
+		++ops[kind];
+		++hits[pc & 0xFFF];
+		if (++since_sample == SAMPLE_EVERY) _sample(chip, pc, sp);
+	}
+	bool skip(OpKind kind, bool skips) { if (!paused) taken[kind] += skips; return skips; }
+	void fast_forward(DWORD n) { if (!paused) fast_forwarded += n; }
+	// FX0A found no key down: it isn't executed, take back its count
+	void stall(WORD pc) { if (!paused) { --ops[OP_LD_KEY]; --hits[pc & 0xFFF]; } }
+	// Nothing is counted while paused, e.g. in frames that are run and then thrown away
+	void pause(bool on) { paused = on; }
+	uint64_t executed(OpKind kind) const { return ops[kind]; }
+	uint64_t skipped(OpKind kind) const { return taken[kind]; }
+	uint64_t total() const;
+	void clear();
+	// Adds another thread's counts and samples to these
+	void merge(const OpProfile& other);
+	void dump(FILE* out) const;
+	// Hottest basic blocks, and the samples as collapsed stacks for flamegraph.pl
+	// ("main;sub_2A0;blk_2A4 1234"). Blocks are found from the counts and the
+	// code in chip's memory, so pass the chip that was profiled.
+	void report(FILE* out, const Chip8& chip) const;
+	void write_stacks(FILE* out, const Chip8& chip) const;
+
+	void _sample(const Chip8& chip, WORD pc, WORD sp);
+};
+
+template <>
+struct OpProfile<false> {
+	void count(OpKind, const Chip8&, WORD, WORD) {}
+	bool skip(OpKind, bool skips) { return skips; }
+	void fast_forward(DWORD) {}
+	void stall(WORD) {}
+	void pause(bool) {}
+	uint64_t executed(OpKind) const { return 0; }
+	uint64_t skipped(OpKind) const { return 0; }
+	uint64_t total() const { return 0; }
+	void clear() {}
+	void merge(const OpProfile&) {}
+	void dump(FILE*) const {}
+	void report(FILE*, const Chip8&) const {}
+	void write_stacks(FILE*, const Chip8&) const {}
+};
+
+template <> uint64_t OpProfile<true>::total() const;
+template <> void OpProfile<true>::clear();
+template <> void OpProfile<true>::merge(const OpProfile<true>& other);
+template <> void OpProfile<true>::dump(FILE* out) const;
+template <> void OpProfile<true>::report(FILE* out, const Chip8& chip) const;
+template <> void OpProfile<true>::write_stacks(FILE* out, const Chip8& chip) const;
+template <> void OpProfile<true>::_sample(const Chip8& chip, WORD pc, WORD sp);
+
+extern thread_local OpProfile<chip8_profiling> chip8_profile;
+
+// CXNN random numbers come from an xorshift64* generator owned by each
+// instance, so runs replay exactly from their seed and instances share nothing.
+// The seed goes through a splitmix64 step first, which never yields the
+// all-zero state xorshift is stuck in.
+inline uint64_t chip8_rng_seed(uint64_t seed) {
+	uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return z != 0 ? z : 1;
+}
+
+inline BYTE chip8_rng_next(uint64_t& state) {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return (BYTE)((state * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+// Why a batch of cycles came back early
+enum RunResult {
+	RUN_BUDGET,   // all cycles spent
+	RUN_DRAW,     // 00E0 or DXYN changed the screen
+	RUN_KEY_WAIT, // FX0A with no key down, not counted as executed
+	RUN_ERROR     // unknown op
+};
+
+// Anything holding code translated from Chip8 memory, told about every write to it
+class Chip8CodeCache {
 public:
-	Chip8() : draw_flag(false), err_flag(false),
-		timer_delay(0), timer_sound(0), IR(0), PC(0x200), SP(0), op(0) {}
+	virtual ~Chip8CodeCache() {}
+	virtual void invalidate(WORD addr, WORD len) = 0;
+};
+
+// Everything a running Chip8 is made of, as written by save_state(). Plain
+// bytes in host byte order with a fixed layout, so a snapshot can be copied,
+// kept in an array or written to a file as is. VERSION goes up whenever the
+// layout or the meaning of a field changes.
+struct Chip8State {
+	enum : uint32_t { MAGIC = 0x38504843, VERSION = 1 }; // "CHP8"
+	enum : BYTE { ERR = 1, WAIT = 2 };
+
+	uint32_t magic;
+	uint32_t version;
+	BYTE V[16];
+	uint16_t pc, ir, sp, keys;
+	uint16_t stack[16];
+	BYTE delay, sound;
+	BYTE flags; // ERR, WAIT
+	BYTE pad;
+	uint32_t ips, timer_acc, vblank;
+	uint64_t rng, seed;
+	uint64_t screen[32];
+	BYTE memory[4096];
+};
+static_assert(sizeof(Chip8State) == 4448, "Chip8State layout changed, bump VERSION");
+
+// Fixed layout, so that many instances pack densely: everything touched by
+// every instruction sits in the first 64 byte line, the stack and the screen
+// follow, then memory. Input mapping belongs to the frontend; the chip only
+// sees which of its 16 keys are down.
+class alignas(64) Chip8 {
+	friend class Chip8Jit;
+	friend class Chip8Native;
+	friend class Chip8Lanes;
+public:
+	Chip8() : PC(0x200), IR(0), SP(0), op(0), keys(0), timer_delay(0), timer_sound(0),
+		draw_flag(false), err_flag(false), wait_flag(false), quiet(false),
+		ips(600), timer_acc(0), vblank(0), rng(chip8_rng_seed(0)), seed_value(0),
+		code_cache(nullptr), fast_forwarded(0) {}
 	~Chip8() {}
+	// Copies share the ROM image reset() goes back to, but not the attached code
+	// cache: a copy starts without one, and a chip assigned over keeps its own,
+	// emptied. Both list every member, keep them in step with the fields below
+	Chip8(const Chip8& other);
+	Chip8& operator=(const Chip8& other);
+	// new only aligns to 16 bytes before C++17
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
 	void initialize();
 	void load_code(const LPBYTE code_buffer, const size_t buffer_size);
 	void emulate_cycle();
+	RunResult run_cycles(DWORD budget, DWORD* executed = nullptr);
+	// Runs up to the next 60Hz tick, letting time pass if FX0A waits. Returns
+	// RUN_ERROR, else RUN_DRAW if anything was drawn, else RUN_KEY_WAIT or RUN_BUDGET
+	RunResult run_frame(DWORD* executed = nullptr);
+	// Back to the state right after the last load_code(), memory included, at
+	// the current ips and seed. One copy of the blocks that differ from it.
 	void reset();
+	// The state load_code() left, shared with every chip started from it
+	std::shared_ptr<const Chip8State> image() const { return pristine; }
+	// In place of load_code() after initialize(): starts from another chip's
+	// image of the same ROM and shares it, at this chip's ips and seed
+	BOOL load_image(std::shared_ptr<const Chip8State> image);
 	BOOL has_error() { return err_flag; }
 	BOOL need_draw() { return draw_flag; }
-
-	void turnon_key(char key) { 
-		keys[keymap[key]] = 1; 
+	BOOL need_key() { return wait_flag; }
+	BOOL is_beeping() { return timer_sound > 0; }
+	// For tools looking at what just ran
+	WORD get_pc() const { return PC; }
+	BYTE peek(WORD addr) const { return memory[addr & 0xFFF]; }
+	WORD get_stack(int level) const { return stack[level & 15]; }
+	// Instructions of delay timer waits passed over without running them, included
+	// in what run_cycles reports as executed
+	uint64_t fast_forwarded_count() const { return fast_forwarded; }
+	// No console output from the chip itself (batch runs)
+	void set_quiet(BOOL on) { quiet = on; }
+	RunResult run_result() {
+		return err_flag ? RUN_ERROR : wait_flag ? RUN_KEY_WAIT : draw_flag ? RUN_DRAW : RUN_BUDGET;
 	}
-	void turnoff_key(char key) { keys[keymap[key]] = 0; }
 
-	void keymap_remap(BYTE remap[256]) {
-		memcpy(remap, keymap, sizeof(remap));
-	}
+	// Bit k set while key k is down
+	void set_keys(WORD mask) { keys = mask; }
 
-public:
-	BYTE screen[64][32];
+	// Instructions per second, the timers stay at 60Hz whatever the rate
+	void set_ips(DWORD rate) { ips = rate > 0 ? rate : 1; }
+	DWORD get_ips() { return ips; }
+	// Number of 60Hz ticks so far, and instructions left until the next one
+	DWORD vblank_count() { return vblank; }
+	DWORD cycles_to_vblank() { return (ips - timer_acc + 59) / 60; }
+	// Let time pass without executing, e.g. while FX0A waits for a key
+	void idle(DWORD cycles) { _advance_timers(cycles); }
 
-private:
-	BOOL draw_flag;
-	BOOL err_flag;
-	BYTE memory[4096];
-	// Chip8 has 4KB memory
+	// Random numbers restart from this seed on initialize() and reset()
+	void seed(uint64_t value) { seed_value = value; rng = chip8_rng_seed(value); }
+	uint64_t get_seed() { return seed_value; }
 
-	// And a graphics system of 64 x 32 pixels
+	// Snapshots of the whole machine. Loading only copies (and drops cached
+	// code for) the 64 byte blocks of memory that differ, so going back and
+	// forth between states of one game costs little more than the registers.
+	// load_state() fails, leaving the chip as it was, on a foreign or outdated blob.
+	void save_state(Chip8State& state) const;
+	BOOL load_state(const Chip8State& state);
+
+private:
+	// First cache line, 64 bytes
 	BYTE V[16];
 	// Chip8 has 15 universal register and 1 carry flag register
 	// Namely V0, V1 ... VE and CF
-	BYTE keys[16];
-	// Shabby keyboard of chip8 only has 16 keys
+	WORD PC;
+	WORD IR;
+	WORD SP;
+	// Respectively program counter and index register and stack pointer
+	WORD op;
+	WORD keys;
+	// Shabby keyboard of chip8 only has 16 keys, one bit each
 	BYTE
 		timer_delay,
 		timer_sound;
 	// There's no hard interrupt but 2 timers counting at 60Hz
-	WORD IR;
-	WORD PC;
-	WORD SP;
-	// Respectively index register and program counter and stack pointer
+	bool draw_flag;
+	bool err_flag;
+	bool wait_flag;
+	// Set by FX0A while no key is down, the cycle is then not finished
+	bool quiet;
+	uint32_t ips;
+	uint32_t timer_acc;
+	uint32_t vblank;
+	// Every instruction adds 60 to timer_acc, the timers tick each time it reaches ips
+	// (not DWORD, which is 8 bytes on LP64)
+	uint64_t rng;
+	uint64_t seed_value;
+	// State of the CXNN generator and where it restarts from
+
+	// Second line
 	WORD stack[16];
-	// Only 16 levels of stack
-	WORD op;
+	// Only 16 levels of stack, deeper calls wrap around to stack[SP & 15]
+	Chip8CodeCache* code_cache;
+	// Attached recompiler, told about every memory write
+	std::shared_ptr<const Chip8State> pristine;
+	// Saved by load_code() for reset(), shared by the chips of one ROM
+	uint64_t fast_forwarded;
+	// Running total of _skip_delay_loop
 
-	BYTE keymap[256] = { 0 };
+public:
+	uint64_t screen[32];
+	// And a graphics system of 64 x 32 pixels
+	// One word per row, bit 63 is the leftmost pixel
 
+private:
+	BYTE memory[4096];
+	// Chip8 has 4KB memory
+
+#ifdef CHIP8_TABLE_DISPATCH
+	struct Instr;
+	typedef void (Chip8::*Handler)(const Instr&);
+	static Handler op_table[16][256];
+	static BOOL _build_op_table();
+
+	// Pre-decoded instruction starting at every even and odd address,
+	// filled on first execution and dropped when its bytes are written
+	struct Instr {
+		Handler fn; // nullptr until decoded
+		WORD op;
+		WORD nnn;
+		BYTE nn;
+		BYTE x, y, n;
+	};
+	Instr icache[4096];
+
+	void _decode(WORD addr);
+	void _invalidate(WORD addr, WORD len);
+#endif
 
 private:
 	void _clear_screen() {
 		memset(screen, 0, sizeof(screen));
-		std::cout << "Clear !" << std::endl;
+		if (!quiet) std::cout << "Clear !" << std::endl;
 	}
 
 	void _error_op(WORD section) {
-		std::cerr << "Unknown OpCode "
+		if (!quiet) std::cerr << "Unknown OpCode "
 			<< "[section " << section << "] : "
 			<< std::hex << std::uppercase << op
 			<< std::endl;
 		err_flag = true;
 	}
 
+	BOOL _key_down(BYTE key) { return (keys >> (key & 0xF)) & 1; }
+
 	void _beep() {
-		std::cout << "Beep" << std::endl;
+		if (!quiet) std::cout << "Beep" << std::endl;
+	}
+
+	void _tick_timers() {
+		timer_acc += 60;
+		if (timer_acc >= ips) {
+			timer_acc -= ips;
+			_vblank();
+		}
 	}
-};
\ No newline at end of file
+
+	void _advance_timers(DWORD cycles) {
+		uint64_t acc = timer_acc + (uint64_t)cycles * 60;
+		uint64_t ticks = acc / ips;
+		timer_acc = (DWORD)(acc % ips);
+		vblank += (DWORD)ticks;
+		timer_delay = ticks >= timer_delay ? 0 : (BYTE)(timer_delay - ticks);
+		if (timer_sound > 0) {
+			if (ticks >= timer_sound) {
+				_beep();
+				timer_sound = 0;
+			}
+			else {
+				timer_sound -= (BYTE)ticks;
+			}
+		}
+	}
+
+	void _vblank() {
+		vblank++;
+		if (timer_delay > 0) timer_delay--;
+		if (timer_sound > 0) {
+			if (timer_sound == 1) {
+				_beep();
+			}
+			timer_sound--;
+		}
+	}
+
+	void _draw_sprite(BYTE vx, BYTE vy, BYTE h);
+	void _store_bcd(BYTE value);
+	void _store_regs(BYTE x);
+	void _memory_written(WORD addr, WORD len);
+	// Runs whole turns of a delay timer spin loop starting at pc in one go, at most
+	// room instructions. PC stays on the loop's FX07, which must be executed next.
+	DWORD _skip_delay_loop(WORD pc, DWORD room);
+
+#ifdef CHIP8_TABLE_DISPATCH
+	// One handler per instruction, all of them leave PC at the next op
+	void _op_cls(const Instr& in);
+	void _op_ret(const Instr& in);
+	void _op_jp(const Instr& in);
+	void _op_call(const Instr& in);
+	void _op_se_imm(const Instr& in);
+	void _op_sne_imm(const Instr& in);
+	void _op_se_reg(const Instr& in);
+	void _op_ld_imm(const Instr& in);
+	void _op_add_imm(const Instr& in);
+	void _op_ld_reg(const Instr& in);
+	void _op_or(const Instr& in);
+	void _op_and(const Instr& in);
+	void _op_xor(const Instr& in);
+	void _op_add_reg(const Instr& in);
+	void _op_sub(const Instr& in);
+	void _op_shr(const Instr& in);
+	void _op_subn(const Instr& in);
+	void _op_shl(const Instr& in);
+	void _op_sne_reg(const Instr& in);
+	void _op_ld_i(const Instr& in);
+	void _op_jp_v0(const Instr& in);
+	void _op_rnd(const Instr& in);
+	void _op_drw(const Instr& in);
+	void _op_skp(const Instr& in);
+	void _op_sknp(const Instr& in);
+	void _op_ld_vx_dt(const Instr& in);
+	void _op_ld_key(const Instr& in);
+	void _op_ld_dt(const Instr& in);
+	void _op_ld_st(const Instr& in);
+	void _op_add_i(const Instr& in);
+	void _op_ld_f(const Instr& in);
+	void _op_ld_bcd(const Instr& in);
+	void _op_ld_store(const Instr& in);
+	void _op_ld_load(const Instr& in);
+	void _op_bad(const Instr& in) { op = in.op; _error_op(op & 0xF000); }
+#endif
+};
+
+#ifndef CHIP8_TABLE_DISPATCH
+// 70 cache lines on 32 and 64 bit builds alike, the decode cache comes on top of it
+static_assert(sizeof(Chip8) == 70 * 64, "Chip8 state is meant to be 4480 bytes");
+#endif
\ No newline at end of file
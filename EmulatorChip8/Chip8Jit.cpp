@@ -0,0 +1,469 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include <cstring>
+#include "Chip8Jit.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CHIP8_JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+// Register usage of the generated code. The entry stub saves the callee-saved
+// registers it pins, so the blocks work under both Win64 and System V:
+//   rbx      - the Chip8 object, V, SP, the stack and memory are addressed from it
+//   esi      - IR, zero extended, written back to the object on the way out
+//   edi      - instructions left in the budget, every block takes its count
+//              off on entry and goes back out if there are not enough
+//   rbp      - the links table, blocks jump through it to the next block
+//   eax, edx - scratch, eax carries the next PC to the next block and back to run()
+// PC is a constant inside a block and only materialized in eax on exit.
+#define RAX 0
+#define RDX 2
+#define RBX 3
+#define RSI 6
+
+#define MEM(field) (reinterpret_cast<BYTE*>(&chip.field) - reinterpret_cast<BYTE*>(&chip))
+
+Chip8Jit::Chip8Jit(Chip8& chip) : chip(chip), code(nullptr), code_used(0), stub_size(0),
+	exit_stub(nullptr), writable(true), out(nullptr)
+{
+	off_V = (DWORD)MEM(V);
+	off_IR = (DWORD)MEM(IR);
+	off_SP = (DWORD)MEM(SP);
+	off_stack = (DWORD)MEM(stack);
+	off_keys = (DWORD)MEM(keys);
+	off_memory = (DWORD)MEM(memory);
+	memset(blocks, 0, sizeof(blocks));
+
+#ifdef CHIP8_JIT_X64
+	// Mapped writable only, _protect() turns it executable before anything runs
+#ifdef _WIN32
+	code = (BYTE*)VirtualAlloc(nullptr, code_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	void* p = mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	code = p == MAP_FAILED ? nullptr : (BYTE*)p;
+#endif
+#endif
+	if (code == nullptr) {
+		std::cerr << "JIT unavailable, falling back to the interpreter." << std::endl;
+	}
+	else {
+		_emit_stubs();
+		_flush();
+	}
+	chip.code_cache = this;
+}
+
+Chip8Jit::~Chip8Jit()
+{
+	chip.code_cache = nullptr;
+	_release();
+}
+
+void Chip8Jit::_release()
+{
+#ifdef CHIP8_JIT_X64
+	if (code) {
+#ifdef _WIN32
+		VirtualFree(code, 0, MEM_RELEASE);
+#else
+		munmap(code, code_size);
+#endif
+	}
+#endif
+	code = nullptr;
+}
+
+BOOL Chip8Jit::_protect(BOOL write)
+{
+	BOOL ok = true;
+#ifdef CHIP8_JIT_X64
+#ifdef _WIN32
+	DWORD old;
+	ok = VirtualProtect(code, code_size, write ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old) != 0;
+	if (ok && !write)
+		FlushInstructionCache(GetCurrentProcess(), code, code_used);
+#else
+	ok = mprotect(code, code_size, write ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+#endif
+	if (ok)
+		writable = write;
+	return ok;
+}
+
+RunResult Chip8Jit::run(DWORD budget, DWORD* executed)
+{
+	DWORD done = 0;
+	chip.draw_flag = false;
+	chip.wait_flag = false;
+
+	while (done < budget) {
+		if (code != nullptr && chip.PC < 0x1000) {
+			Block& b = blocks[chip.PC].valid ? blocks[chip.PC] : _translate(chip.PC);
+			if (b.fn != nullptr && b.count <= budget - done) {
+				if (writable && !_protect(false)) {
+					std::cerr << "JIT code can't be made executable, falling back to the interpreter." << std::endl;
+					_release();
+					continue;
+				}
+				DWORD left = budget - done;
+				chip.PC = (WORD)((EnterFn)code)(&chip, links, chip.PC, &left);
+				// None of the translated instructions look at the timers,
+				// so the ticks of the whole chain can be applied once it is over
+				chip._advance_timers(budget - done - left);
+				done = budget - left;
+				continue;
+			}
+		}
+		// FX07 is never translated, so delay timer spin loops come through here
+		done += chip._skip_delay_loop(chip.PC, budget - done - 1);
+		chip.emulate_cycle();
+		if (chip.wait_flag) break; // FX0A still waiting, not executed
+		++done;
+		if (chip.draw_flag || chip.err_flag) break;
+	}
+	if (executed) *executed = done;
+	return chip.run_result();
+}
+
+RunResult Chip8Jit::run_frame(DWORD* executed)
+{
+	BOOL drawn = false;
+	DWORD total = 0;
+	DWORD frame = chip.vblank;
+	while (chip.vblank == frame && !chip.err_flag) {
+		DWORD done = 0;
+		RunResult result = run(chip.cycles_to_vblank(), &done);
+		total += done;
+		if (result == RUN_DRAW) drawn = true;
+		if (result == RUN_KEY_WAIT) {
+			// The timers keep counting while FX0A waits
+			chip.idle(chip.cycles_to_vblank());
+		}
+	}
+	if (executed) *executed = total;
+	return chip.err_flag ? RUN_ERROR : drawn ? RUN_DRAW : chip.wait_flag ? RUN_KEY_WAIT : RUN_BUDGET;
+}
+
+void Chip8Jit::invalidate(WORD addr, WORD len)
+{
+	int lo = addr - max_block_ops * 2;
+	int hi = addr + len;
+	if (lo < 0) lo = 0;
+	if (hi > 4096) hi = 4096;
+	for (int a = lo; a < hi; ++a) {
+		if (blocks[a].valid && blocks[a].end > addr) {
+			blocks[a].valid = false;
+			links[a] = exit_stub;
+		}
+	}
+}
+
+void Chip8Jit::_flush()
+{
+	memset(blocks, 0, sizeof(blocks));
+	for (int a = 0; a < 4096; ++a)
+		links[a] = exit_stub;
+	code_used = stub_size;
+}
+
+void Chip8Jit::_emit_stubs()
+{
+	out = code;
+	// Entry: save what gets pinned, load the pinned registers and jump to pc
+	_emit(0x53);                                      // push rbx
+	_emit(0x56);                                      // push rsi
+	_emit(0x57);                                      // push rdi
+	_emit(0x55);                                      // push rbp
+#ifdef _WIN32
+	_emit(0x48); _emit(0x89); _emit(0xCB);            // mov rbx, rcx
+	_emit(0x48); _emit(0x89); _emit(0xD5);            // mov rbp, rdx
+	_emit(0x44); _emit(0x89); _emit(0xC0);            // mov eax, r8d
+	_emit(0x41); _emit(0x51);                         // push r9
+#else
+	_emit(0x48); _emit(0x89); _emit(0xFB);            // mov rbx, rdi
+	_emit(0x48); _emit(0x89); _emit(0xF5);            // mov rbp, rsi
+	_emit(0x89); _emit(0xD0);                         // mov eax, edx
+	_emit(0x51);                                      // push rcx
+#endif
+	_emit(0x48); _emit(0x8B); _emit(0x14); _emit(0x24); // mov rdx, [rsp]
+	_emit(0x8B); _emit(0x3A);                         // mov edi, [rdx]
+	_emit(0x0F); _emit_mem(0xB7, RSI, off_IR);        // movzx esi, word [IR]
+	_emit(0xFF); _emit(0x64); _emit(0xC5); _emit(0x00); // jmp [rbp + rax * 8]
+
+	// Exit, eax holds the next PC: store IR and the budget left, restore and return
+	exit_stub = out;
+	_emit(0x66); _emit_mem(0x89, RSI, off_IR);        // mov word [IR], si
+	_emit(0x5A);                                      // pop rdx
+	_emit(0x89); _emit(0x3A);                         // mov [rdx], edi
+	_emit(0x5D);                                      // pop rbp
+	_emit(0x5F);                                      // pop rdi
+	_emit(0x5E);                                      // pop rsi
+	_emit(0x5B);                                      // pop rbx
+	_emit(0xC3);                                      // ret
+	stub_size = out - code;
+}
+
+Chip8Jit::Block& Chip8Jit::_translate(WORD pc)
+{
+	if (!writable && !_protect(true)) {
+		Block& b = blocks[pc];
+		b.fn = nullptr;
+		b.end = pc + 2;
+		b.count = 0;
+		b.valid = true;
+		return b;
+	}
+
+	// Worst case per instruction is FX65 with 16 loads and stores
+	const size_t max_block_bytes = max_block_ops * 16 * 22 + 64;
+	if (code_used + max_block_bytes > code_size)
+		_flush();
+
+	Block& b = blocks[pc];
+	BYTE* entry = code + code_used;
+	out = entry;
+	b.count = 0;
+
+	// The count is only known at the end, the sub and its bail out are patched then
+	_emit(0x81); _emit(0xEF); _emit32(0);             // sub edi, count
+	_emit(0x0F); _emit(0x82); _emit32(0);             // jb bail
+	BYTE* body = out;
+
+	WORD addr = pc;
+	BOOL ends_block = false;
+	while (!ends_block && b.count < max_block_ops && addr + 1 < 0x1000) {
+		WORD op = chip.memory[addr] << 8 | chip.memory[addr + 1];
+		if (!_emit_op(addr, op, ends_block))
+			break;
+		++b.count;
+		addr += 2;
+	}
+	if (!ends_block)
+		_emit_exit(addr);
+
+	b.fn = b.count ? entry : nullptr;
+	b.end = b.count ? addr : pc + 2;
+	b.valid = true;
+	if (b.count) {
+		// Not enough budget left for the whole block: give the count back and leave at pc
+		BYTE* bail = out;
+		_emit(0x81); _emit(0xC7); _emit32(b.count);   // add edi, count
+		_emit(0xB8); _emit32(pc);                     // mov eax, pc
+		_emit(0xE9); _emit_rel32(exit_stub);          // jmp exit
+		BYTE* end = out;
+		out = entry + 2; _emit32(b.count);
+		out = body - 4; _emit_rel32(bail);
+		out = end;
+		code_used += out - entry;
+		links[pc] = entry;
+	}
+	return b;
+}
+
+void Chip8Jit::_emit_mem(BYTE opcode, BYTE reg, DWORD disp)
+{
+	_emit(opcode);
+	_emit(0x80 | reg << 3 | RBX); // [rbx + disp32]
+	_emit32(disp);
+}
+
+void Chip8Jit::_emit_exit(DWORD next_pc)
+{
+	_emit(0xB8); _emit32(next_pc);                    // mov eax, next_pc
+	if (next_pc < 0x1000) {
+		_emit(0xFF); _emit(0xA5); _emit32(next_pc * 8); // jmp [rbp + next_pc * 8]
+	}
+	else {
+		_emit(0xE9); _emit_rel32(exit_stub);          // jmp exit
+	}
+}
+
+void Chip8Jit::_emit_dispatch()
+{
+	// Next PC computed in eax, only addresses inside memory have a link
+	_emit(0x3D); _emit32(0xFFF);                      // cmp eax, 0xFFF
+	_emit(0x0F); _emit(0x87); _emit_rel32(exit_stub); // ja exit
+	_emit(0xFF); _emit(0x64); _emit(0xC5); _emit(0x00); // jmp [rbp + rax * 8]
+}
+
+void Chip8Jit::_emit_select_exit(BYTE jcc, WORD pc)
+{
+	// Flags are set by the caller, skip to pc + 4 when the condition holds
+	_emit(0x0F); _emit(jcc); _emit32(0);              // jcc skip
+	BYTE* patch = out - 4;
+	_emit_exit(pc + 2);
+	BYTE* skip = out;
+	out = patch; _emit_rel32(skip);
+	out = skip;
+	_emit_exit(pc + 4);
+}
+
+BOOL Chip8Jit::_emit_op(WORD pc, WORD op, BOOL& ends_block)
+{
+	const DWORD vx = off_V + BIT2(op);
+	const DWORD vy = off_V + BIT1(op);
+	const DWORD vf = off_V + 0xF;
+
+	switch (chip8_op_kind(op))
+	{
+	case OP_LD_IMM:
+		_emit_mem(0xC6, 0, vx); _emit(LOW8(op));          // mov byte [Vx], nn
+		return true;
+	case OP_ADD_IMM:
+		_emit_mem(0x80, 0, vx); _emit(LOW8(op));          // add byte [Vx], nn
+		return true;
+	case OP_LD_REG:
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(0x88, RAX, vx);                         // mov [Vx], al
+		return true;
+	case OP_OR:
+	case OP_AND:
+	case OP_XOR: {
+		static const BYTE alu[] = { 0x08, 0x20, 0x30 };   // or / and / xor r/m8, r8
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(alu[chip8_op_kind(op) - OP_OR], RAX, vx);
+		return true;
+	}
+	case OP_ADD_REG:
+		_emit_mem(0x8A, RAX, vx);                         // mov al, [Vx]
+		_emit_mem(0x02, RAX, vy);                         // add al, [Vy]
+		_emit(0x0F); _emit(0x92); _emit(0xC0);            // setc al
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(0x00, RAX, vx);                         // add [Vx], al
+		return true;
+	case OP_SUB:
+		_emit_mem(0x8A, RAX, vx);                         // mov al, [Vx]
+		_emit_mem(0x3A, RAX, vy);                         // cmp al, [Vy]
+		_emit(0x0F); _emit(0x93); _emit(0xC0);            // setae al
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(0x28, RAX, vx);                         // sub [Vx], al
+		return true;
+	case OP_SUBN:
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(0x3A, RAX, vx);                         // cmp al, [Vx]
+		_emit(0x0F); _emit(0x93); _emit(0xC0);            // setae al
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit_mem(0x8A, RAX, vy);                         // mov al, [Vy]
+		_emit_mem(0x2A, RAX, vx);                         // sub al, [Vx]
+		_emit_mem(0x88, RAX, vx);                         // mov [Vx], al
+		return true;
+	case OP_SHR:
+		_emit_mem(0x8A, RAX, vx);                         // mov al, [Vx]
+		_emit(0x24); _emit(0x01);                         // and al, 1
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit_mem(0xD0, 5, vx);                           // shr byte [Vx], 1
+		return true;
+	case OP_SHL:
+		_emit_mem(0x8A, RAX, vx);                         // mov al, [Vx]
+		_emit(0xC0); _emit(0xE8); _emit(0x07);            // shr al, 7
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit_mem(0xD0, 4, vx);                           // shl byte [Vx], 1
+		return true;
+	case OP_LD_I:
+		_emit(0xBE); _emit32(ADDR(op));                   // mov esi, nnn
+		return true;
+	case OP_ADD_I:
+		_emit(0x0F); _emit_mem(0xB6, RDX, vx);            // movzx edx, byte [Vx]
+		_emit(0x8D); _emit(0x04); _emit(0x16);            // lea eax, [rsi + rdx]
+		_emit(0x3D); _emit32(0xFFF);                      // cmp eax, 0xFFF
+		_emit(0x0F); _emit(0x97); _emit(0xC0);            // seta al
+		_emit_mem(0x88, RAX, vf);                         // mov [VF], al
+		_emit(0x66); _emit(0x01); _emit(0xD6);            // add si, dx
+		return true;
+	case OP_LD_F:
+		_emit(0x0F); _emit_mem(0xB6, RAX, vx);            // movzx eax, byte [Vx]
+		_emit(0x8D); _emit(0x34); _emit(0x80);            // lea esi, [rax + rax * 4]
+		return true;
+	case OP_LD_LOAD:
+		for (int i = 0; i <= BIT2(op); ++i) {
+			_emit(0x8D); _emit(0x56); _emit(i);           // lea edx, [rsi + i]
+			_emit(0x81); _emit(0xE2); _emit32(0xFFF);     // and edx, 0xFFF
+			_emit(0x8A); _emit(0x84); _emit(0x13);        // mov al, [rbx + rdx + memory]
+			_emit32(off_memory);
+			_emit_mem(0x88, RAX, off_V + i);              // mov [Vi], al
+		}
+		_emit(0x66); _emit(0x81); _emit(0xC6); _emit16(BIT2(op) + 1); // add si, x + 1
+		return true;
+
+	// Block terminators
+	case OP_JP:
+		ends_block = true;
+		_emit_exit(ADDR(op));
+		return true;
+	case OP_JP_V0:
+		ends_block = true;
+		_emit(0x0F); _emit_mem(0xB6, RAX, off_V);         // movzx eax, byte [V0]
+		_emit(0x05); _emit32(ADDR(op));                   // add eax, nnn
+		_emit_dispatch();
+		return true;
+	case OP_CALL:
+		ends_block = true;
+		_emit(0x0F); _emit_mem(0xB7, RAX, off_SP);        // movzx eax, word [SP]
+		_emit(0x83); _emit(0xE0); _emit(0x0F);            // and eax, 15
+		_emit(0x66); _emit(0xC7); _emit(0x84); _emit(0x43); // mov word [rbx + rax * 2 + stack], pc
+		_emit32(off_stack); _emit16(pc);
+		_emit(0x66); _emit_mem(0xFF, 0, off_SP);          // inc word [SP]
+		_emit_exit(ADDR(op));
+		return true;
+	case OP_RET:
+		ends_block = true;
+		_emit(0x66); _emit_mem(0xFF, 1, off_SP);          // dec word [SP]
+		_emit(0x0F); _emit_mem(0xB7, RAX, off_SP);        // movzx eax, word [SP]
+		_emit(0x83); _emit(0xE0); _emit(0x0F);            // and eax, 15
+		_emit(0x0F); _emit(0xB7); _emit(0x84); _emit(0x43); // movzx eax, word [rbx + rax * 2 + stack]
+		_emit32(off_stack);
+		_emit(0x83); _emit(0xC0); _emit(0x02);            // add eax, 2
+		_emit_dispatch();
+		return true;
+	case OP_SE_IMM:
+	case OP_SNE_IMM:
+		ends_block = true;
+		_emit_mem(0x80, 7, vx); _emit(LOW8(op));          // cmp byte [Vx], nn
+		_emit_select_exit(chip8_op_kind(op) == OP_SE_IMM ? 0x84 : 0x85, pc);
+		return true;
+	case OP_SE_REG:
+	case OP_SNE_REG:
+		ends_block = true;
+		_emit_mem(0x8A, RAX, vx);                         // mov al, [Vx]
+		_emit_mem(0x3A, RAX, vy);                         // cmp al, [Vy]
+		_emit_select_exit(chip8_op_kind(op) == OP_SE_REG ? 0x84 : 0x85, pc);
+		return true;
+	case OP_SKP:
+	case OP_SKNP:
+		ends_block = true;
+		_emit(0x0F); _emit_mem(0xB6, RDX, vx);            // movzx edx, byte [Vx]
+		_emit(0x83); _emit(0xE2); _emit(0x0F);            // and edx, 15
+		_emit(0x0F); _emit_mem(0xB7, RAX, off_keys);      // movzx eax, word [keys]
+		_emit(0x0F); _emit(0xA3); _emit(0xD0);            // bt eax, edx
+		_emit_select_exit(chip8_op_kind(op) == OP_SKP ? 0x82 : 0x83, pc); // key down in CF
+		return true;
+
+	default:
+		// Screen, timers, RNG, key wait, memory writes and bad ops
+		return false;
+	}
+}
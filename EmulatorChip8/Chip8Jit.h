@@ -0,0 +1,90 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include "Chip8.h"
+
+// Basic-block recompiler from CHIP-8 to x86-64.
+// Straight-line register, index and stack instructions are translated up to
+// the next branch; everything touching the screen, timers, RNG, key wait or
+// memory writes is left to Chip8::emulate_cycle, which stays the fallback.
+// Blocks jump straight to the next translated block, so run() only sees the
+// chain again when it reaches one of those instructions or the budget ends.
+// Blocks are dropped when FX33/FX55 (or a reload) write over their bytes.
+class Chip8Jit : public Chip8CodeCache {
+public:
+	Chip8Jit(Chip8& chip);
+	~Chip8Jit();
+
+	// Same contract as Chip8::run_cycles
+	RunResult run(DWORD budget, DWORD* executed = nullptr);
+	// Same contract as Chip8::run_frame
+	RunResult run_frame(DWORD* executed = nullptr);
+	void invalidate(WORD addr, WORD len) override;
+	BOOL available() { return code != nullptr; }
+
+private:
+	// Entry stub at the start of the code buffer: runs blocks from pc on,
+	// takes the budget left and returns the next PC with what is left of it
+	typedef DWORD (*EnterFn)(Chip8* chip, const BYTE** links, DWORD pc, DWORD* left);
+
+	struct Block {
+		BYTE* fn;     // nullptr when the first instruction must be interpreted
+		WORD end;     // one past the last byte translated
+		WORD count;   // instructions executed by one pass
+		BOOL valid;
+	};
+
+	static const int max_block_ops = 32;
+	static const size_t code_size = 1 << 20;
+
+	Chip8& chip;
+	Block blocks[4096];
+	// Indexed by the guest address the block starts at
+	const BYTE* links[4096];
+	// Where a jump to each guest address goes: its block, or back to run()
+	BYTE* code;
+	size_t code_used;
+	// Bump allocated, everything is flushed when it runs out
+	size_t stub_size;
+	// The entry and exit stubs, kept by a flush
+	BYTE* exit_stub;
+	BOOL writable;
+	// Pages are either writable or executable, never both
+
+	Block& _translate(WORD pc);
+	void _flush();
+	void _emit_stubs();
+	BOOL _protect(BOOL write);
+	void _release();
+
+	// Emitter
+	BYTE* out;
+	void _emit(BYTE b) { *out++ = b; }
+	void _emit16(WORD w) { _emit(w & 0xFF); _emit(w >> 8); }
+	void _emit32(DWORD d) { _emit16(d & 0xFFFF); _emit16(d >> 16); }
+	void _emit_rel32(const BYTE* target) { _emit32((DWORD)(target - (out + 4))); }
+	void _emit_mem(BYTE opcode, BYTE reg, DWORD disp);
+	void _emit_exit(DWORD next_pc);
+	void _emit_dispatch();
+	void _emit_select_exit(BYTE jcc, WORD pc);
+	BOOL _emit_op(WORD pc, WORD op, BOOL& ends_block);
+
+	DWORD off_V, off_IR, off_SP, off_stack, off_keys, off_memory;
+};
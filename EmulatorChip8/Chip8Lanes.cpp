@@ -0,0 +1,401 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include <algorithm>
+#include <cstring>
+#include "Chip8Lanes.h"
+
+// Lane selectors for _exec. With AllLanes the loops run over contiguous
+// arrays and vectorise; LaneList walks one regrouped set of lanes.
+struct AllLanes {
+	size_t operator[](size_t k) const { return k; }
+};
+
+struct LaneList {
+	const uint32_t* ids;
+	size_t operator[](size_t k) const { return ids[k]; }
+};
+
+Chip8Lanes::Chip8Lanes(size_t lanes) : lanes(lanes), ips(600), timer_acc(0), vblank(0),
+	v(16 * lanes), pc(lanes), ir(lanes), sp(lanes), stack(16 * lanes),
+	delay(lanes), sound(lanes), keys(lanes), err(lanes), seeds(lanes), rng(lanes), stalls(lanes), halted(lanes), steps(0), stopped(0),
+	mem(new BYTE[4096 * lanes]), dirty(lanes), scr(32 * lanes),
+	pc_seen(4096), pc_slot(4096), slot(lanes), group(lanes)
+{
+}
+
+void Chip8Lanes::load(const BYTE* code, size_t size)
+{
+	std::fill(v.begin(), v.end(), 0);
+	std::fill(pc.begin(), pc.end(), 0x200);
+	std::fill(ir.begin(), ir.end(), 0);
+	std::fill(sp.begin(), sp.end(), 0);
+	std::fill(stack.begin(), stack.end(), 0);
+	std::fill(delay.begin(), delay.end(), 0);
+	std::fill(sound.begin(), sound.end(), 0);
+	std::fill(keys.begin(), keys.end(), 0);
+	std::fill(err.begin(), err.end(), 0);
+	for (size_t i = 0; i < lanes; ++i)
+		rng[i] = chip8_rng_seed(seeds[i]);
+	std::fill(stalls.begin(), stalls.end(), 0);
+	std::fill(halted.begin(), halted.end(), 0);
+	steps = 0;
+	stopped = 0;
+	std::fill(pc_seen.begin(), pc_seen.end(), 0);
+	std::fill(scr.begin(), scr.end(), 0);
+	std::fill(dirty.begin(), dirty.end(), 0);
+	written = 0;
+	timer_acc = 0;
+	vblank = 0;
+
+	memset(image, 0, sizeof(image));
+	memcpy(image, chip8_fontset, sizeof(chip8_fontset));
+	memcpy(image + 0x200, code, size);
+}
+
+void Chip8Lanes::step()
+{
+	steps++;
+
+	// Common case: every lane is running, on the same PC, in memory none of them wrote to
+	WORD at = pc[0];
+	BYTE same = true;
+	for (size_t i = 0; i < lanes; ++i)
+		same &= pc[i] == at;
+	uint64_t blocks = 1ULL << ((at & 0xFFF) >> 6) | 1ULL << (((at + 1) & 0xFFF) >> 6);
+	if (same && stopped == 0 && !(written & blocks)) {
+		_exec(image[at & 0xFFF] << 8 | image[(at + 1) & 0xFFF], AllLanes(), lanes);
+		_tick();
+		return;
+	}
+
+	// Otherwise regroup the running lanes by instruction and run one group at a time
+	distinct.clear();
+	for (size_t i = 0; i < lanes; ++i) {
+		if (err[i]) continue;
+		WORD a = pc[i] & 0xFFF;
+		uint64_t own = 1ULL << (a >> 6) | 1ULL << (((a + 1) & 0xFFF) >> 6);
+		if (!(dirty[i] & own)) {
+			// Lanes on the same PC of the shared image run the same instruction
+			if (pc_seen[a] != steps) {
+				pc_seen[a] = steps;
+				pc_slot[a] = (uint32_t)distinct.size();
+				distinct.push_back(image[a] << 8 | image[(a + 1) & 0xFFF]);
+			}
+			slot[i] = pc_slot[a];
+			continue;
+		}
+		// Code the lane wrote itself, rare enough for a linear search
+		WORD op = _read(i, a) << 8 | _read(i, a + 1);
+		uint32_t d = 0;
+		while (d < distinct.size() && distinct[d] != op) ++d;
+		if (d == distinct.size()) distinct.push_back(op);
+		slot[i] = d;
+	}
+	start.assign(distinct.size() + 1, 0);
+	for (size_t i = 0; i < lanes; ++i) {
+		if (!err[i]) start[slot[i] + 1]++;
+	}
+	for (size_t d = 0; d < distinct.size(); ++d)
+		start[d + 1] += start[d];
+	cursor.assign(start.begin(), start.end() - 1);
+	for (size_t i = 0; i < lanes; ++i) {
+		if (!err[i]) group[cursor[slot[i]]++] = (uint32_t)i;
+	}
+	for (size_t d = 0; d < distinct.size(); ++d)
+		_exec(distinct[d], LaneList{ &group[start[d]] }, start[d + 1] - start[d]);
+	_tick();
+}
+
+void Chip8Lanes::run_frame()
+{
+	for (DWORD n = (ips - timer_acc + 59) / 60; n > 0; --n)
+		step();
+}
+
+void Chip8Lanes::_tick()
+{
+	// Waiting lanes tick too, as in Chip8::run_frame; stopped lanes don't
+	timer_acc += 60;
+	if (timer_acc < ips) return;
+	timer_acc -= ips;
+	vblank++;
+	for (size_t i = 0; i < lanes; ++i) {
+		BYTE live = !err[i];
+		delay[i] -= (delay[i] != 0) & live;
+		sound[i] -= (sound[i] != 0) & live;
+	}
+}
+
+template <class Lanes>
+void Chip8Lanes::_exec(WORD op, Lanes at, size_t n)
+{
+	const int x = BIT2(op), y = BIT1(op);
+	const BYTE nn = LOW8(op);
+	const WORD nnn = ADDR(op);
+	BYTE* vx = &v[x * lanes];
+	BYTE* vy = &v[y * lanes];
+	BYTE* vf = &v[0xF * lanes];
+	WORD* p = pc.data();
+
+	switch (chip8_op_kind(op))
+	{
+	case OP_CLS:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			memset(&scr[i * 32], 0, 32 * sizeof(uint64_t));
+			p[i] += 2;
+		}
+		break;
+	case OP_RET:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			sp[i]--;
+			p[i] = stack[(sp[i] & 15) * lanes + i] + 2;
+		}
+		break;
+	case OP_JP:
+		for (size_t k = 0; k < n; ++k) p[at[k]] = nnn;
+		break;
+	case OP_CALL:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			stack[(sp[i] & 15) * lanes + i] = p[i];
+			sp[i]++;
+			p[i] = nnn;
+		}
+		break;
+	case OP_SE_IMM:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += vx[i] == nn ? 4 : 2; }
+		break;
+	case OP_SNE_IMM:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += vx[i] != nn ? 4 : 2; }
+		break;
+	case OP_SE_REG:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += vx[i] == vy[i] ? 4 : 2; }
+		break;
+	case OP_SNE_REG:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += vx[i] != vy[i] ? 4 : 2; }
+		break;
+	case OP_LD_IMM:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] = nn; p[i] += 2; }
+		break;
+	case OP_ADD_IMM:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] += nn; p[i] += 2; }
+		break;
+	case OP_LD_REG:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] = vy[i]; p[i] += 2; }
+		break;
+	case OP_OR:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] |= vy[i]; p[i] += 2; }
+		break;
+	case OP_AND:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] &= vy[i]; p[i] += 2; }
+		break;
+	case OP_XOR:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] ^= vy[i]; p[i] += 2; }
+		break;
+	// VF is written before the result, exactly as emulate_cycle does it,
+	// which matters when X or Y is F
+	case OP_ADD_REG:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = vy[i] > 0xFF - vx[i];
+			vx[i] += vy[i];
+			p[i] += 2;
+		}
+		break;
+	case OP_SUB:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = !(vy[i] > vx[i]);
+			vx[i] -= vy[i];
+			p[i] += 2;
+		}
+		break;
+	case OP_SHR:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = vx[i] & 0x1;
+			vx[i] >>= 1;
+			p[i] += 2;
+		}
+		break;
+	case OP_SUBN:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = !(vx[i] > vy[i]);
+			vx[i] = vy[i] - vx[i];
+			p[i] += 2;
+		}
+		break;
+	case OP_SHL:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = vx[i] >> 7;
+			vx[i] <<= 1;
+			p[i] += 2;
+		}
+		break;
+	case OP_LD_I:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; ir[i] = nnn; p[i] += 2; }
+		break;
+	case OP_JP_V0:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] = nnn + v[i]; }
+		break;
+	case OP_RND:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] = chip8_rng_next(rng[i]) & nn; p[i] += 2; }
+		break;
+	case OP_DRW:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			_draw_sprite(i, vx[i], vy[i], BIT0(op));
+			p[i] += 2;
+		}
+		break;
+	case OP_SKP:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += (keys[i] >> (vx[i] & 15)) & 1 ? 4 : 2; }
+		break;
+	case OP_SKNP:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; p[i] += (keys[i] >> (vx[i] & 15)) & 1 ? 2 : 4; }
+		break;
+	case OP_LD_VX_DT:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; vx[i] = delay[i]; p[i] += 2; }
+		break;
+	case OP_LD_KEY:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			if (keys[i] == 0) {
+				stalls[i]++; // Still waiting, doesn't count as executed (nor in run_cycles)
+				continue;
+			}
+			// The highest key down wins, as the loop in emulate_cycle leaves it
+			BYTE key = 15;
+			while (!(keys[i] >> key & 1)) --key;
+			vx[i] = key;
+			p[i] += 2;
+		}
+		break;
+	case OP_LD_DT:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; delay[i] = vx[i]; p[i] += 2; }
+		break;
+	case OP_LD_ST:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; sound[i] = vx[i]; p[i] += 2; }
+		break;
+	case OP_ADD_I:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			vf[i] = ir[i] + vx[i] > 0xFFF;
+			ir[i] += vx[i];
+			p[i] += 2;
+		}
+		break;
+	case OP_LD_F:
+		for (size_t k = 0; k < n; ++k) { size_t i = at[k]; ir[i] = vx[i] * 0x5; p[i] += 2; }
+		break;
+	case OP_LD_BCD:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			BYTE value = vx[i];
+			_write(i, ir[i], value / 100);
+			_write(i, ir[i] + 1, (value / 10) % 10);
+			_write(i, ir[i] + 2, (value % 100) % 10);
+			p[i] += 2;
+		}
+		break;
+	case OP_LD_STORE:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			for (int r = 0; r <= x; ++r)
+				_write(i, ir[i] + r, v[r * lanes + i]);
+			ir[i] += x + 1;
+			p[i] += 2;
+		}
+		break;
+	case OP_LD_LOAD:
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			for (int r = 0; r <= x; ++r)
+				v[r * lanes + i] = _read(i, ir[i] + r);
+			ir[i] += x + 1;
+			p[i] += 2;
+		}
+		break;
+	default: // OP_BAD, the lane stops where it is like run_cycles does, which counts the op
+		for (size_t k = 0; k < n; ++k) {
+			size_t i = at[k];
+			err[i] = true;
+			halted[i] = steps - stalls[i];
+			stopped++;
+		}
+		break;
+	}
+}
+
+void Chip8Lanes::_write(size_t i, WORD addr, BYTE value)
+{
+	addr &= 0xFFF;
+	uint64_t block = 1ULL << (addr >> 6);
+	if (!(dirty[i] & block)) {
+		// First write to this block, give the lane its own copy
+		WORD base = addr & ~63;
+		memcpy(&mem[i * 4096 + base], image + base, 64);
+		dirty[i] |= block;
+		written |= block;
+	}
+	mem[i * 4096 + addr] = value;
+}
+
+void Chip8Lanes::_draw_sprite(size_t i, BYTE vx, BYTE vy, BYTE h)
+{
+	// Same packed rows and wrap-around as Chip8::_draw_sprite
+	uint64_t* screen = &scr[i * 32];
+	int x = vx & 63;
+	int y = vy & 31;
+	BYTE hit = 0;
+
+	for (int r = 0; r < h; ++r) {
+		uint64_t row = (uint64_t)_read(i, ir[i] + r) << 56;
+		row = (row >> x) | (row << ((64 - x) & 63));
+		uint64_t& line = screen[(y + r) & 31];
+		hit |= (line & row) != 0;
+		line ^= row;
+	}
+	v[0xF * lanes + i] = hit;
+}
+
+bool Chip8Lanes::compare(size_t lane, const Chip8& chip, uint64_t executed) const
+{
+	if (err[lane] != (chip.err_flag != 0)) return false;
+	if (cycles(lane) != executed) return false;
+	for (int r = 0; r < 16; ++r) {
+		if (v[r * lanes + lane] != chip.V[r]) return false;
+	}
+	for (int s = 0; s < 16 && s < chip.SP; ++s) {
+		if (stack[s * lanes + lane] != chip.stack[s]) return false;
+	}
+	if (pc[lane] != chip.PC || ir[lane] != chip.IR || sp[lane] != chip.SP) return false;
+	if (delay[lane] != chip.timer_delay || sound[lane] != chip.timer_sound) return false;
+	if (rng[lane] != chip.rng) return false;
+	// A stopped reference doesn't get to the end of its frame
+	if (!err[lane] && (timer_acc != chip.timer_acc || vblank != chip.vblank)) return false;
+	for (WORD addr = 0; addr < 4096; ++addr) {
+		if (_read(lane, addr) != chip.memory[addr]) return false;
+	}
+	return memcmp(&scr[lane * 32], chip.screen, sizeof(chip.screen)) == 0;
+}
@@ -0,0 +1,112 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include "Chip8.h"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Many instances of one ROM run in lockstep, one instruction on every lane
+// per step. Registers, timers and stacks are stored as structure-of-arrays
+// (register x of lane i at v[x * lanes + i]), so an instruction shared by all
+// lanes runs as one straight loop over contiguous arrays that the compiler
+// turns into SIMD code. Lanes that have diverged to different instructions
+// are regrouped by opcode each step and every group runs on its own.
+//
+// Memory is the ROM image shared by all lanes, plus a private copy of each
+// 64 byte block a lane has written to with FX33 or FX55.
+//
+// Experimental: on a single thread, 64 copies of each ROM in roms/ with the
+// same input run 1.2-3.2x faster than 64 Chip8s on the ROMs whose copies stay
+// together, but 0.4-0.7x on those where the copies' random numbers send them
+// different ways, and 0.6-0.85x over the whole set. Chip8Batch only uses it
+// with -l.
+//
+// A lane behaves like a Chip8 driven by run_frame(), with its keys only
+// changing between frames. Time keeps passing while a lane waits on FX0A, so
+// the 60Hz ticks, which depend on nothing but the instruction rate, are
+// shared by every lane.
+class Chip8Lanes {
+public:
+	explicit Chip8Lanes(size_t lanes);
+
+	// initialize() and load_code() on every lane
+	void load(const BYTE* code, size_t size);
+	// Like Chip8::seed(), takes effect on the next load()
+	void seed(size_t lane, uint64_t value) { seeds[lane] = value; }
+	void set_ips(DWORD rate) { ips = rate > 0 ? rate : 1; }
+	void set_keys(size_t lane, WORD mask) { keys[lane] = mask; }
+
+	void step();
+	// Runs every lane up to the next 60Hz tick
+	void run_frame();
+
+	size_t size() const { return lanes; }
+	BOOL has_error(size_t lane) const { return err[lane]; }
+	uint64_t cycles(size_t lane) const { return err[lane] ? halted[lane] : steps - stalls[lane]; }
+	const uint64_t* screen(size_t lane) const { return &scr[lane * 32]; }
+
+	// Differential check against the reference core, true if the lane is in the same state
+	// and has run as many instructions as the reference says it executed
+	bool compare(size_t lane, const Chip8& chip, uint64_t executed) const;
+
+private:
+	size_t lanes;
+	DWORD ips;
+	DWORD timer_acc;
+	DWORD vblank;
+
+	std::vector<BYTE> v;        // v[x * lanes + i]
+	std::vector<WORD> pc, ir, sp;
+	std::vector<WORD> stack;    // stack[level * lanes + i]
+	std::vector<BYTE> delay, sound;
+	std::vector<WORD> keys;     // bit k set while key k is down
+	std::vector<BYTE> err;
+	std::vector<uint64_t> seeds, rng;
+	std::vector<uint64_t> stalls; // steps spent waiting on FX0A
+	std::vector<uint64_t> halted; // instructions executed before an unknown opcode
+	uint64_t steps;
+	size_t stopped;             // lanes with err set
+	BYTE image[4096];           // memory as loaded, the same for every lane
+	std::unique_ptr<BYTE[]> mem; // mem[i * 4096 + addr], only valid in the lane's dirty blocks
+	std::vector<uint64_t> dirty; // bit b set once lane i has its own copy of block b
+	uint64_t written;           // all the lanes' dirty blocks
+	std::vector<uint64_t> scr;  // scr[i * 32 + row], same layout as Chip8::screen
+
+	// Regrouping, by instruction, of lanes that have diverged
+	std::vector<WORD> distinct; // instructions seen this step
+	std::vector<uint64_t> pc_seen; // step in which a PC last got its entry in distinct
+	std::vector<uint32_t> pc_slot;
+	std::vector<uint32_t> slot; // index into distinct of every lane
+	std::vector<uint32_t> start; // first entry in group of every instruction
+	std::vector<uint32_t> cursor;
+	std::vector<uint32_t> group; // lanes ordered by slot
+
+	template <class Lanes>
+	void _exec(WORD op, Lanes at, size_t n);
+	void _tick();
+	BYTE _read(size_t i, WORD addr) const {
+		addr &= 0xFFF;
+		return (dirty[i] >> (addr >> 6) & 1) ? mem[i * 4096 + addr] : image[addr];
+	}
+	void _write(size_t i, WORD addr, BYTE value);
+	void _draw_sprite(size_t i, BYTE vx, BYTE vy, BYTE h);
+};
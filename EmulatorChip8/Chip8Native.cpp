@@ -0,0 +1,79 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include <cstring>
+#include "Chip8Native.h"
+
+Chip8Native::Chip8Native(Chip8& chip, const Chip8NativeImage& image) : chip(chip), matched(false)
+{
+	memset(map, 0, sizeof(map));
+	if (image.rom_size <= sizeof(chip.memory) - 0x200 &&
+		memcmp(chip.memory + 0x200, image.rom, image.rom_size) == 0) {
+		for (DWORD i = 0; i < image.block_count; ++i) {
+			if (image.blocks[i].start < 0x1000)
+				map[image.blocks[i].start] = &image.blocks[i];
+		}
+		matched = true;
+	}
+	else {
+		std::cerr << "Native image " << image.name
+			<< " does not match the loaded ROM, falling back to the interpreter." << std::endl;
+	}
+	chip.code_cache = this;
+}
+
+Chip8Native::~Chip8Native()
+{
+	chip.code_cache = nullptr;
+}
+
+RunResult Chip8Native::run(DWORD budget, DWORD* executed)
+{
+	DWORD done = 0;
+	chip.draw_flag = false;
+	chip.wait_flag = false;
+
+	while (done < budget) {
+		const Chip8NativeBlock* b = chip.PC < 0x1000 ? map[chip.PC] : nullptr;
+		if (b != nullptr && done + b->count <= budget) {
+			chip.PC = (WORD)b->fn(chip);
+			done += b->count;
+			// Blocks end right after a draw, errors and FX0A are never translated
+			if (chip.draw_flag) break;
+			continue;
+		}
+		chip.emulate_cycle();
+		if (chip.wait_flag) break; // FX0A still waiting, not executed
+		++done;
+		if (chip.draw_flag || chip.err_flag) break;
+	}
+	if (executed) *executed = done;
+	return chip.run_result();
+}
+
+void Chip8Native::invalidate(WORD addr, WORD len)
+{
+	int lo = addr - max_block_ops * 2;
+	int hi = addr + len;
+	if (lo < 0) lo = 0;
+	if (hi > 4096) hi = 4096;
+	for (int a = lo; a < hi; ++a) {
+		if (map[a] != nullptr && map[a]->end > addr)
+			map[a] = nullptr;
+	}
+}
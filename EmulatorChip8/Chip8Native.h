@@ -0,0 +1,75 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include "Chip8.h"
+
+// Native code for one ROM, generated ahead of time by Chip8Recompiler.
+// Each block returns the next PC. A block only runs while the bytes it was
+// translated from are unchanged; unknown targets, FX0A and everything after
+// a write to the code go through Chip8::emulate_cycle.
+struct Chip8NativeBlock {
+	WORD start;
+	WORD end;     // one past the last byte translated
+	WORD count;   // instructions executed by one call
+	DWORD (*fn)(Chip8& c);
+};
+
+struct Chip8NativeImage {
+	const char* name;
+	const BYTE* rom;
+	DWORD rom_size;
+	const Chip8NativeBlock* blocks;
+	DWORD block_count;
+};
+
+class Chip8Native : public Chip8CodeCache {
+public:
+	Chip8Native(Chip8& chip, const Chip8NativeImage& image);
+	~Chip8Native();
+
+	// Same contract as Chip8::run_cycles
+	RunResult run(DWORD budget, DWORD* executed = nullptr);
+	void invalidate(WORD addr, WORD len) override;
+	BOOL available() { return matched; }
+
+	// State access for the generated code
+	static BYTE* regs(Chip8& c) { return c.V; }
+	static BOOL key(Chip8& c, BYTE k) { return c._key_down(k); }
+	static BYTE* memory(Chip8& c) { return c.memory; }
+	static WORD* stack(Chip8& c) { return c.stack; }
+	static WORD& IR(Chip8& c) { return c.IR; }
+	static WORD& SP(Chip8& c) { return c.SP; }
+	static BYTE& delay(Chip8& c) { return c.timer_delay; }
+	static BYTE& sound(Chip8& c) { return c.timer_sound; }
+	static void tick(Chip8& c) { c._tick_timers(); }
+	static void cls(Chip8& c) { c._clear_screen(); c.draw_flag = true; }
+	static void draw(Chip8& c, BYTE x, BYTE y, BYTE h) { c._draw_sprite(x, y, h); }
+	static void bcd(Chip8& c, BYTE value) { c._store_bcd(value); }
+	static void store(Chip8& c, BYTE x) { c._store_regs(x); }
+	static BYTE rnd(Chip8& c) { return chip8_rng_next(c.rng); }
+
+	static const int max_block_ops = 32;
+
+private:
+	Chip8& chip;
+	const Chip8NativeBlock* map[4096];
+	// Indexed by start address, nullptr once invalidated
+	BOOL matched;
+};
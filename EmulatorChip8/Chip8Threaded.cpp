@@ -0,0 +1,316 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include <cstring>
+#include "Chip8.h"
+
+// Batched core behind run_cycles. PC, IR, SP and V live in locals for the
+// whole batch and are written back on exit or before a helper needs them.
+//
+// On GCC and Clang it is threaded code: every handler ends with its own fetch
+// and indirect jump, so each instruction gets a jump site of its own in the
+// branch predictor instead of the single one shared by a switch. Clang takes
+// labels as values too, so there is no separate [[clang::musttail]] variant;
+// it would produce the same jump-per-handler code. Other compilers run the
+// same handlers from a switch.
+//
+// Built with CHIP8_TABLE_DISPATCH, run_cycles in Chip8.cpp goes through the
+// pre-decoded instruction cache instead and this file is left empty.
+
+#ifndef CHIP8_TABLE_DISPATCH
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CHIP8_COMPUTED_GOTO
+#endif
+
+static BYTE run_kinds[16][256];
+
+static BOOL build_run_kinds()
+{
+	for (int hi = 0; hi < 16; ++hi)
+		for (int lo = 0; lo < 256; ++lo)
+			run_kinds[hi][lo] = chip8_op_kind(hi << 12 | lo);
+	return true;
+}
+
+RunResult Chip8::run_cycles(DWORD budget, DWORD* executed)
+{
+	static const BOOL kinds_ready = build_run_kinds();
+	(void)kinds_ready;
+#ifdef CHIP8_COMPUTED_GOTO
+	static const void* labels[OP_KINDS] = {
+		&&op_cls, &&op_ret, &&op_jp, &&op_call,
+		&&op_se_imm, &&op_sne_imm, &&op_se_reg, &&op_ld_imm, &&op_add_imm,
+		&&op_ld_reg, &&op_or, &&op_and, &&op_xor, &&op_add_reg, &&op_sub, &&op_shr, &&op_subn, &&op_shl,
+		&&op_sne_reg, &&op_ld_i, &&op_jp_v0, &&op_rnd, &&op_drw, &&op_skp, &&op_sknp,
+		&&op_ld_vx_dt, &&op_ld_key, &&op_ld_dt, &&op_ld_st, &&op_add_i, &&op_ld_f,
+		&&op_ld_bcd, &&op_ld_store, &&op_ld_load,
+		&&op_bad
+	};
+#endif
+
+	DWORD done = 0;
+	RunResult result = RUN_BUDGET;
+	WORD o;
+	BYTE kind;
+	WORD pc = PC, ir = IR, sp = SP;
+	BYTE v[16];
+	memcpy(v, V, sizeof(v));
+
+	draw_flag = false;
+	wait_flag = false;
+	if (budget == 0) goto finish;
+
+#define SYNC_OUT() \
+	do { PC = pc; IR = ir; SP = sp; memcpy(V, v, sizeof(v)); } while (0)
+
+#define FETCH() \
+	do { \
+		o = memory[pc & 0xFFF] << 8 | memory[(pc + 1) & 0xFFF]; \
+		kind = run_kinds[o >> 12][LOW8(o)]; \
+		chip8_profile.count((OpKind)kind, *this, pc, sp); \
+	} while (0)
+
+#ifdef CHIP8_COMPUTED_GOTO
+#define HANDLER(name) name:
+#define DISPATCH() \
+	do { FETCH(); goto *labels[kind]; } while (0)
+#else
+#define HANDLER(name) case name##_kind:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() \
+	do { \
+		_tick_timers(); \
+		if (++done == budget) goto finish; \
+		DISPATCH(); \
+	} while (0)
+
+#define STOP(why) \
+	do { result = why; ++done; goto finish; } while (0)
+
+#ifdef CHIP8_COMPUTED_GOTO
+	DISPATCH();
+#else
+	enum {
+		op_cls_kind = OP_CLS, op_ret_kind = OP_RET, op_jp_kind = OP_JP, op_call_kind = OP_CALL,
+		op_se_imm_kind = OP_SE_IMM, op_sne_imm_kind = OP_SNE_IMM, op_se_reg_kind = OP_SE_REG,
+		op_ld_imm_kind = OP_LD_IMM, op_add_imm_kind = OP_ADD_IMM,
+		op_ld_reg_kind = OP_LD_REG, op_or_kind = OP_OR, op_and_kind = OP_AND, op_xor_kind = OP_XOR,
+		op_add_reg_kind = OP_ADD_REG, op_sub_kind = OP_SUB, op_shr_kind = OP_SHR,
+		op_subn_kind = OP_SUBN, op_shl_kind = OP_SHL,
+		op_sne_reg_kind = OP_SNE_REG, op_ld_i_kind = OP_LD_I, op_jp_v0_kind = OP_JP_V0,
+		op_rnd_kind = OP_RND, op_drw_kind = OP_DRW, op_skp_kind = OP_SKP, op_sknp_kind = OP_SKNP,
+		op_ld_vx_dt_kind = OP_LD_VX_DT, op_ld_key_kind = OP_LD_KEY, op_ld_dt_kind = OP_LD_DT,
+		op_ld_st_kind = OP_LD_ST, op_add_i_kind = OP_ADD_I, op_ld_f_kind = OP_LD_F,
+		op_ld_bcd_kind = OP_LD_BCD, op_ld_store_kind = OP_LD_STORE, op_ld_load_kind = OP_LD_LOAD,
+		op_bad_kind = OP_BAD
+	};
+dispatch:
+	FETCH();
+	switch (kind)
+	{
+#endif
+
+HANDLER(op_cls)
+	pc += 2;
+	_clear_screen();
+	draw_flag = true;
+	_tick_timers();
+	STOP(RUN_DRAW);
+HANDLER(op_ret)
+	pc = stack[--sp & 15] + 2;
+	NEXT();
+HANDLER(op_jp)
+	pc = ADDR(o);
+	NEXT();
+HANDLER(op_call)
+	stack[sp++ & 15] = pc;
+	pc = ADDR(o);
+	NEXT();
+HANDLER(op_se_imm)
+	pc += chip8_profile.skip(OP_SE_IMM, v[BIT2(o)] == LOW8(o)) ? 4 : 2;
+	NEXT();
+HANDLER(op_sne_imm)
+	pc += chip8_profile.skip(OP_SNE_IMM, v[BIT2(o)] != LOW8(o)) ? 4 : 2;
+	NEXT();
+HANDLER(op_se_reg)
+	pc += chip8_profile.skip(OP_SE_REG, v[BIT2(o)] == v[BIT1(o)]) ? 4 : 2;
+	NEXT();
+HANDLER(op_ld_imm)
+	v[BIT2(o)] = LOW8(o);
+	pc += 2;
+	NEXT();
+HANDLER(op_add_imm)
+	v[BIT2(o)] += LOW8(o);
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_reg)
+	v[BIT2(o)] = v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_or)
+	v[BIT2(o)] |= v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_and)
+	v[BIT2(o)] &= v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_xor)
+	v[BIT2(o)] ^= v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_add_reg)
+	v[0xF] = v[BIT1(o)] > (0xFF - v[BIT2(o)]);
+	v[BIT2(o)] += v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_sub)
+	v[0xF] = v[BIT1(o)] <= v[BIT2(o)];
+	v[BIT2(o)] -= v[BIT1(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_shr)
+	v[0xF] = v[BIT2(o)] & 0x1;
+	v[BIT2(o)] >>= 1;
+	pc += 2;
+	NEXT();
+HANDLER(op_subn)
+	v[0xF] = v[BIT2(o)] <= v[BIT1(o)];
+	v[BIT2(o)] = v[BIT1(o)] - v[BIT2(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_shl)
+	v[0xF] = v[BIT2(o)] >> 7;
+	v[BIT2(o)] <<= 1;
+	pc += 2;
+	NEXT();
+HANDLER(op_sne_reg)
+	pc += chip8_profile.skip(OP_SNE_REG, v[BIT2(o)] != v[BIT1(o)]) ? 4 : 2;
+	NEXT();
+HANDLER(op_ld_i)
+	ir = ADDR(o);
+	pc += 2;
+	NEXT();
+HANDLER(op_jp_v0)
+	pc = ADDR(o) + v[0];
+	NEXT();
+HANDLER(op_rnd)
+	v[BIT2(o)] = chip8_rng_next(rng) & LOW8(o);
+	pc += 2;
+	NEXT();
+HANDLER(op_drw)
+	pc += 2;
+	SYNC_OUT();
+	_draw_sprite(v[BIT2(o)], v[BIT1(o)], BIT0(o));
+	v[0xF] = V[0xF];
+	_tick_timers();
+	STOP(RUN_DRAW);
+HANDLER(op_skp)
+	pc += chip8_profile.skip(OP_SKP, _key_down(v[BIT2(o)]) != 0) ? 4 : 2;
+	NEXT();
+HANDLER(op_sknp)
+	pc += chip8_profile.skip(OP_SKNP, !_key_down(v[BIT2(o)])) ? 4 : 2;
+	NEXT();
+HANDLER(op_ld_vx_dt)
+	if (timer_delay != 0) {
+		// Fast-forward a busy wait on the delay timer, keeping this FX07 to run
+		done += _skip_delay_loop(pc, budget - done - 1);
+	}
+	v[BIT2(o)] = timer_delay;
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_key)
+	wait_flag = true;
+	for (int i = 0; i < 16; ++i) {
+		if (_key_down(i)) {
+			v[BIT2(o)] = i;
+			wait_flag = false;
+		}
+	}
+	if (wait_flag) {
+		// FX0A halts the timers as well, and isn't executed until a key is down
+		chip8_profile.stall(pc);
+		result = RUN_KEY_WAIT;
+		goto finish;
+	}
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_dt)
+	timer_delay = v[BIT2(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_st)
+	timer_sound = v[BIT2(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_add_i)
+	v[0xF] = ir + v[BIT2(o)] > 0xFFF;
+	ir += v[BIT2(o)];
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_f)
+	ir = v[BIT2(o)] * 0x5;
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_bcd)
+	IR = ir;
+	_store_bcd(v[BIT2(o)]);
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_store)
+	IR = ir;
+	memcpy(V, v, sizeof(v));
+	_store_regs(BIT2(o));
+	ir = IR;
+	pc += 2;
+	NEXT();
+HANDLER(op_ld_load)
+	for (int i = 0; i <= BIT2(o); ++i)
+		v[i] = memory[(ir + i) & 0xFFF];
+	ir += BIT2(o) + 1;
+	pc += 2;
+	NEXT();
+HANDLER(op_bad)
+	op = o;
+	_error_op(op & 0xF000);
+	STOP(RUN_ERROR);
+
+#ifndef CHIP8_COMPUTED_GOTO
+	}
+#endif
+
+#undef STOP
+#undef NEXT
+#undef DISPATCH
+#undef HANDLER
+#undef FETCH
+#undef SYNC_OUT
+
+finish:
+	PC = pc;
+	IR = ir;
+	SP = sp;
+	memcpy(V, v, sizeof(v));
+	if (executed) *executed = done;
+	return result;
+}
+
+#endif
@@ -25,16 +25,234 @@
 */
 
 #include "Chip8.h"
+#include "Chip8Jit.h"
 #include "Grapher.h"
 #include "Timer.h"
 #include "Utils.h"
 
+#include "TripleBuffer.h"
+#include "Rewind.h"
+#include "Trace.h"
+#include "Histogram.h"
+
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <memory>
+
+struct Frame {
+    uint64_t rows[32];
+    uint32_t key_seq;   // key presses the emulator had seen when it made this frame
+};
+
+// Everything the SDL thread and the emulation thread share
+struct Shared {
+    TripleBuffer<Frame> frames;
+    std::atomic<WORD> keys;     // bit i set while key i is down
+    std::atomic<int> speed;     // emulated frames per real frame
+    std::atomic<bool> reset;
+    std::atomic<bool> quit;
+    std::atomic<bool> rewinding;  // Backspace held
+    std::atomic<bool> dump_profile;
+    std::atomic<uint32_t> key_seq;  // counts key presses, bumped after keys is set
+
+    // Time between emulated frames, recorded by the emulation thread. Time
+    // in SDL_RenderPresent and from a key press to the first frame that
+    // shows a change after it, by the SDL thread
+    LatencyHistogram frame_time;
+    LatencyHistogram present_time;
+    LatencyHistogram key_latency;
+
+    // The emulation thread sleeps here while FX0A waits for a key
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::atomic<bool> blocked;
+
+    Shared() : keys(0), speed(1), reset(false), quit(false), rewinding(false), dump_profile(false), key_seq(0),
+        frame_time("frame"), present_time("present"), key_latency("key"), blocked(false) {}
+
+    // Called by the SDL thread after touching keys, reset, quit, rewinding or dump_profile
+    void notify() {
+        std::lock_guard<std::mutex> lock(wake_lock);
+        wake.notify_one();
+    }
+};
+
+// Opcode counts and the hottest blocks to the console, the sampled call stacks
+// to chip8.folded for flamegraph.pl. Called from the thread running the chip
+static void dump_profile(const Chip8& chip)
+{
+    if (!chip8_profiling) {
+        std::cout << "Opcode counts need a build with CHIP8_PROFILE defined.\n";
+        return;
+    }
+    chip8_profile.dump(stdout);
+    chip8_profile.report(stdout, chip);
+    FILE* folded = nullptr;
+    if (fopen_s(&folded, "chip8.folded", "w") == 0) {
+        chip8_profile.write_stacks(folded, chip);
+        fclose(folded);
+        std::cout << "Call stacks written to chip8.folded\n";
+    }
+}
+
+void emulation_loop(Chip8& chip, Chip8Jit* jit, Shared& shared, Rewind* rewind, DWORD runahead)
+{
+    // The JIT works on the chip's own state, so rewind and run-ahead don't change
+    auto run_frame = [&]() { return jit != nullptr ? jit->run_frame() : chip.run_frame(); };
+    Timer clock;
+    DWORD frames = 0;
+    bool drawn = true;
+    Chip8State snapshot;
+    Chip8State ahead;
+    uint64_t ahead_rows[32];
+    // Run-ahead cost, reported every 5 seconds
+    double ahead_us = 0;
+    DWORD ahead_count = 0;
+    // Start of the last frame, 0 after sleeping on FX0A
+    uint64_t frame_start = 0;
+
+    Trace::name_thread("emulation");
+    clock.start();
+    while (!shared.quit) {
+        uint64_t now_ns = Timer::nowNs();
+        if (frame_start != 0) {
+            shared.frame_time.record(now_ns - frame_start);
+        }
+        frame_start = now_ns;
+
+        if (shared.reset.exchange(false)) {
+            std::cout << "CPU Reset.\n";
+            chip.reset();
+        }
+        if (shared.dump_profile.exchange(false)) {
+            dump_profile(chip);
+        }
+        // Read before keys, so the presses it counts are all in there
+        uint32_t key_seq = shared.key_seq.load(std::memory_order_acquire);
+        chip.set_keys(shared.keys);
+
+        if (shared.rewinding && rewind != nullptr) {
+            // One snapshot back per real frame, the pace they were taken at
+            TRACE_SCOPE("rewind");
+            if (rewind->pop(snapshot)) {
+                chip.load_state(snapshot);
+                drawn = true;
+            }
+        }
+        else {
+            // At speed N, N emulated frames go by in every real one
+            int speed = shared.speed;
+            {
+                TRACE_SCOPE("run_frame");
+                for (int i = 0; i < speed && !chip.has_error(); ++i) {
+                    drawn |= run_frame() == RUN_DRAW;
+                }
+            }
+            if (chip.has_error()) {
+                shared.quit = true;
+                break;
+            }
+            if (rewind != nullptr) {
+                TRACE_SCOPE("rewind push");
+                chip.save_state(snapshot);
+                rewind->push(snapshot);
+            }
+        }
+
+        const uint64_t* shown = chip.screen;
+        if (runahead > 0 && !shared.rewinding) {
+            // Show the screen runahead frames from now, as if the keys stay as they
+            // are, then go back. Games that only read keys once per loop react
+            // that many frames sooner
+            TRACE_SCOPE("run-ahead");
+            auto start = std::chrono::steady_clock::now();
+            chip.save_state(ahead);
+            chip.set_quiet(true);
+            // These frames are run again for real, don't count them twice
+            chip8_profile.pause(true);
+            for (DWORD i = 0; i < runahead && !chip.has_error(); ++i) {
+                drawn |= run_frame() == RUN_DRAW;
+            }
+            chip8_profile.pause(false);
+            memcpy(ahead_rows, chip.screen, sizeof(ahead_rows));
+            shown = ahead_rows;
+            chip.set_quiet(false);
+            chip.load_state(ahead);
+            ahead_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+            if (++ahead_count == 300) {
+                double per_frame = ahead_us / ahead_count;
+                printf("Run-ahead %lu: %.1fus per frame, %.2f%% of a 60Hz frame\n",
+                    (unsigned long)runahead, per_frame, per_frame / (1000000.0 / 60) * 100);
+                ahead_us = 0;
+                ahead_count = 0;
+            }
+        }
+        if (drawn) {
+            memcpy(shared.frames.back().rows, shown, sizeof(chip.screen));
+            shared.frames.back().key_seq = key_seq;
+            shared.frames.publish();
+            drawn = false;
+        }
+
+        if (chip.need_key() && !chip.is_beeping() && !shared.rewinding) {
+            // Nothing changes until a key goes down, sleep until then and
+            // catch the delay timer up with the time spent asleep afterwards
+            Timer asleep;
+            asleep.start();
+            {
+                TRACE_SCOPE("key wait");
+                std::unique_lock<std::mutex> lock(shared.wake_lock);
+                shared.blocked = true;
+                shared.wake.wait(lock, [&shared] {
+                    return shared.keys != 0 || shared.reset || shared.quit || shared.rewinding
+                        || shared.dump_profile;
+                });
+                shared.blocked = false;
+            }
+            uint64_t cycles = (uint64_t)asleep.getTicks() * chip.get_ips() * shared.speed / 1000;
+            chip.idle(cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (DWORD)cycles);
+
+            // The SDL thread may be blocked in SDL_WaitEvent, wake it for the frames to come
+            SDL_Event wakeup = {};
+            wakeup.type = SDL_USEREVENT;
+            SDL_PushEvent(&wakeup);
+
+            frames = 0;
+            clock.start();
+            frame_start = 0;
+            continue;
+        }
+
+        // Frame n is due at n * 1000 / 60 ms, so the rounding doesn't accumulate
+        DWORD due = ++frames * 1000 / 60;
+        DWORD now = clock.getTicks();
+        if (now < due) {
+            TRACE_SCOPE("SDL_Delay");
+            SDL_Delay(due - now);
+        }
+        else if (now - due > 250) {
+            // Too far behind (or the window was dragged), don't try to catch up
+            frames = 0;
+            clock.start();
+        }
+    }
+
+    // The counts belong to this thread
+    if (chip8_profiling) {
+        dump_profile(chip);
+    }
+}
 
 int main(int argc, char **argv)
 {
-    int FPS = 200;          // frame per second
-    int TPS = 1000 / FPS;   // ticks per frame
+    int speed = 1;          // 60Hz frames emulated per real frame
     
     // Set Console size
     SMALL_RECT srect = { 0, 0, 400, 300 };
@@ -45,10 +263,10 @@ int main(int argc, char **argv)
     Configure conf;
     conf.load_config();
     _tprintf(TEXT("Emulator will start with\n")
-        TEXT("FPS       = %d\n")
+        TEXT("IPS       = %d\n")
         TEXT("KeyRemap  = %s\n")
         TEXT("ROM       = %s\n"), 
-        conf.get_fps(), 
+        conf.get_ips(), 
         conf.get_keymap_stat() == nullptr ? TEXT("None") : conf.get_keymap_stat(), 
         conf.get_default_rom() == nullptr ? TEXT("Not specified") : conf.get_default_rom());
     
@@ -73,11 +291,21 @@ int main(int argc, char **argv)
     std::cout << "Initializing Emulator..." << std::endl;
 
     Chip8 chip;
+    // CXNN replays exactly from the seed, which is printed so a run can be repeated with seed= in chip8.ini
+    chip.seed(conf.get_seed() != 0 ? conf.get_seed() : (uint64_t)time(nullptr));
+    std::cout << "Seed: " << chip.get_seed() << std::endl;
     chip.initialize();
     chip.load_code(buffer, filesize);
+    chip.set_ips(conf.get_ips());
     delete[] buffer;
-    if (conf.get_keymap_on()) {
-        chip.keymap_remap(conf.get_keymap());
+
+    // jit=1 in chip8.ini. Where no executable memory can be had the interpreter
+    // runs on its own, rather than the JIT stepping through emulate_cycle
+    std::unique_ptr<Chip8Jit> jit;
+    if (conf.get_jit()) {
+        jit.reset(new Chip8Jit(chip));
+        if (!jit->available()) jit.reset();
+        std::cout << "JIT: " << (jit ? "on" : "off") << std::endl;
     }
 
     std::cout << "Emulator Ready." << std::endl;
@@ -104,84 +332,168 @@ int main(int argc, char **argv)
         return -3;
     }        
 
-    FPS = conf.get_fps();
-    TPS = 1000 / FPS;
+    SDL_Texture* gfx_screen = sdl_create_screen(gfx_renderer);
+    if (gfx_screen == nullptr) {
+        std::cerr << "Failure at Displayer[SDL Texture] initialization." << std::endl;
+        SDL_DestroyRenderer(gfx_renderer);
+        SDL_DestroyWindow(gfx_window);
+        return -4;
+    }
 
     std::cout << "Displayer ready." << std::endl;
 
     //------------------------------------------------------------------------------------------------
 
-    BOOL is_to_quit = FALSE;
-    SDL_Event gfx_event;    
-
+    Shared shared;
+    // Up to 10 minutes of one snapshot per frame, a few dozen bytes each
+    std::unique_ptr<Rewind> rewind;
+    if (conf.get_rewind_mb() > 0) {
+        rewind.reset(new Rewind((size_t)conf.get_rewind_mb() << 20, 60 * 60 * 10));
+    }
+    if (conf.get_trace() != nullptr) {
+        Trace::start(conf.get_trace());
+        Trace::name_thread("SDL");
+    }
     std::cout << "Main Loop Start." << std::endl;
 
-    Timer fpsTimer;
-    Timer capTimer;
-    int countedFrames = 0;
-    fpsTimer.start();
+    // A key press waiting for the first frame made after it that looks different
+    // from the screen at the time, which is when the press became visible
+    bool key_pending = false;
+    uint32_t pending_seq = 0;
+    uint64_t pending_ns = 0;
+    uint64_t pending_rows[32];
+    auto present = [&]() {
+        const Frame& frame = shared.frames.front();
+        sdl_draw(frame.rows, gfx_renderer, gfx_screen, &shared.present_time);
+        if (!key_pending) return;
+        uint64_t now = Timer::nowNs();
+        if (now - pending_ns > 1000000000) {
+            // Nothing changed for a second, the game ignored it
+            key_pending = false;
+        }
+        else if ((int32_t)(frame.key_seq - pending_seq) >= 0
+            && memcmp(frame.rows, pending_rows, sizeof(pending_rows)) != 0) {
+            shared.key_latency.record(now - pending_ns);
+            key_pending = false;
+        }
+    };
 
-    while (!is_to_quit) {
-        capTimer.start();
-        //Sleep(100);
-        if (SDL_PollEvent(&gfx_event)) {
-            switch (gfx_event.type)
-            {
-            case SDL_QUIT:
-                is_to_quit = TRUE;
-                break;
-            case SDL_KEYDOWN:
-                switch (gfx_event.key.keysym.sym)
+    // Emulation runs on its own thread, rendering and input stay here with SDL
+    std::thread emulator(emulation_loop, std::ref(chip), jit.get(), std::ref(shared), rewind.get(), conf.get_runahead());
+    present();
+
+    SDL_Event gfx_event;
+    while (!shared.quit) {
+        // Handle every pending event before drawing, waiting at most 1ms for one.
+        // While the emulator sleeps on FX0A there is nothing to draw, so block.
+        bool waited;
+        if (shared.blocked) {
+            // The last frame was published before blocked was set
+            if (shared.frames.update()) {
+                present();
+            }
+            TRACE_SCOPE("SDL_WaitEvent");
+            waited = SDL_WaitEvent(&gfx_event) != 0;
+        }
+        else {
+            TRACE_SCOPE("SDL_WaitEvent");
+            waited = SDL_WaitEventTimeout(&gfx_event, 1) != 0;
+        }
+        if (waited) {
+            TRACE_SCOPE("events");
+            do {
+                switch (gfx_event.type)
                 {
-                case SDLK_ESCAPE:
-                    is_to_quit = TRUE;
-                    break;
-                case SDLK_UP:
-                    FPS += 5;
-                    TPS = 1000 / FPS;
-                    if (FPS >= 1000) TPS = 1;
-                    std::cout << "FPS UP:" << FPS << "\n";
-                    break;
-                case SDLK_DOWN:
-                    FPS -= 5;
-                    if (FPS <= 10) FPS = 10;
-                    TPS = 1000 / FPS;
-                    std::cout << "FPS DOWN:" << FPS << "\n";
+                case SDL_QUIT:
+                    shared.quit = true;
+                    shared.notify();
                     break;
-                case SDLK_MINUS:
-                    std::cout << "CPU Reset.\n";
-                    chip.reset();
+                case SDL_KEYDOWN:
+                    switch (gfx_event.key.keysym.sym)
+                    {
+                    case SDLK_ESCAPE:
+                        shared.quit = true;
+                        shared.notify();
+                        break;
+                    case SDLK_UP:
+                        speed += speed >= 10 ? 10 : 1;
+                        if (speed > 100) speed = 100;
+                        shared.speed = speed;
+                        std::cout << "Speed UP:" << speed << "x\n";
+                        break;
+                    case SDLK_DOWN:
+                        speed -= speed > 10 ? 10 : 1;
+                        if (speed < 1) speed = 1;
+                        shared.speed = speed;
+                        std::cout << "Speed DOWN:" << speed << "x\n";
+                        break;
+                    case SDLK_MINUS:
+                        shared.reset = true;
+                        shared.notify();
+                        break;
+                    case SDLK_BACKSPACE:
+                        shared.rewinding = true;
+                        shared.notify();
+                        break;
+                    case SDLK_F1:
+                        shared.dump_profile = true;
+                        shared.notify();
+                        break;
+                    default: {
+                        BYTE key = conf.key_of(gfx_event.key.keysym.sym);
+                        if (key != Configure::NO_KEY) {
+                            shared.keys.fetch_or((WORD)(1 << key));
+                            uint32_t seq = shared.key_seq.fetch_add(1, std::memory_order_release) + 1;
+                            if (!key_pending && gfx_event.key.repeat == 0) {
+                                key_pending = true;
+                                pending_seq = seq;
+                                pending_ns = Timer::nowNs();
+                                memcpy(pending_rows, shared.frames.front().rows, sizeof(pending_rows));
+                            }
+                            shared.notify();
+                        }
+                        break;
+                    }
+                    }
                     break;
-                default:
-                    chip.turnon_key(gfx_event.key.keysym.sym);                
+                case SDL_KEYUP: {
+                    if (gfx_event.key.keysym.sym == SDLK_BACKSPACE) {
+                        shared.rewinding = false;
+                    }
+                    BYTE key = conf.key_of(gfx_event.key.keysym.sym);
+                    if (key != Configure::NO_KEY) {
+                        shared.keys.fetch_and((WORD)~(1 << key));
+                    }
                     break;
                 }
-                break;
-            case SDL_KEYUP:
-                chip.turnoff_key(gfx_event.key.keysym.sym);                
-                break;
-            }
-            continue;
+                }
+            } while (SDL_PollEvent(&gfx_event));
         }
 
-        chip.emulate_cycle();
-        if (chip.has_error()) break;
-        if (chip.need_draw()) {
-            sdl_draw(chip.screen, gfx_renderer);            
+        if (shared.frames.update()) {
+            present();
         }
+    }
+    emulator.join();
 
-        ++countedFrames;
-
-        int frameTicks = capTimer.getTicks();
-        if (frameTicks < TPS)
-        {
-            SDL_Delay(TPS - frameTicks);
-        }
-        // Control FPS, 'cause modern computers are merely too fast for chip8
+    // Both threads are done recording
+    shared.frame_time.dump(stdout);
+    shared.present_time.dump(stdout);
+    shared.key_latency.dump(stdout);
+    FILE* latency = nullptr;
+    if (conf.get_latency() != nullptr && _tfopen_s(&latency, conf.get_latency(), TEXT("w")) == 0) {
+        shared.frame_time.dump(latency, true);
+        shared.present_time.dump(latency, true);
+        shared.key_latency.dump(latency, true);
+        fclose(latency);
     }
+    Trace::flush();
 
     std::cout << "User Termination. Clearing Up..." << std::endl;
 
+    if (gfx_screen) {
+        SDL_DestroyTexture(gfx_screen);
+    }
     if (gfx_renderer) {
         SDL_DestroyRenderer(gfx_renderer);
     }
@@ -3,6 +3,11 @@
 #include <Windows.h>
 #include <conio.h>
 #include <SDL.h>
+#include <cstdint>
+
+#include "Histogram.h"
+#include "Timer.h"
+#include "Trace.h"
 
 const int scaler = 15;
 const int HEIGHT = 32 * scaler;
@@ -11,11 +16,16 @@ const int WIDTH = 64 * scaler;
 static HANDLE hcon = GetStdHandle(STD_OUTPUT_HANDLE);
 static char scr_buffer[64][32];
 
-void graph_draw(BYTE scr[64][32]) {
+// The framebuffer keeps one 64-bit word per row, leftmost pixel in bit 63
+inline BYTE screen_pixel(const uint64_t scr[32], int x, int y) {
+	return (scr[y] >> (63 - x)) & 1;
+}
+
+void graph_draw(const uint64_t scr[32]) {
 	SetConsoleCursorPosition(hcon, { 0,0 });
 	for (int y = 0; y < 32; ++y) {
 		for (int x = 0; x < 64; ++x) {
-			scr_buffer[x][y] = scr[x][y] == 1 ? '#' : ' ';
+			scr_buffer[x][y] = screen_pixel(scr, x, y) == 1 ? '#' : ' ';
 		}
 	}
 	for (int y = 0; y < 32; ++y) {
@@ -26,27 +36,31 @@ void graph_draw(BYTE scr[64][32]) {
 	}
 }	
 
-void sdl_draw(BYTE scr[64][32], SDL_Renderer * renderer, BOOL line_scan_on = FALSE) {
-	SDL_Rect pix_rect = { 0, 0, scaler, scaler };
+// The screen lives in a 64 x 32 streaming texture, SDL scales it up to the window
+SDL_Texture* sdl_create_screen(SDL_Renderer* renderer) {
+	return SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+}
 
-	for (int y = 0; y < 32; ++y) {
-		for (int x = 0; x < 64; ++x) {			
-			if (scr[x][y] != scr_buffer[x][y]) {
-				if (scr[x][y] == 1) {
-					SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-				}
-				else {
-					SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-				}
-				pix_rect.x = x * scaler;
-				pix_rect.y = y * scaler;
-				SDL_RenderFillRect(renderer, &pix_rect);
-				scr_buffer[x][y] = scr[x][y];
+// present_time, when given, gets how long SDL_RenderPresent took
+void sdl_draw(const uint64_t scr[32], SDL_Renderer* renderer, SDL_Texture* texture, LatencyHistogram* present_time = nullptr) {
+	TRACE_SCOPE("sdl_draw");
+	void* pixels;
+	int pitch;
+
+	if (SDL_LockTexture(texture, nullptr, &pixels, &pitch) == 0) {
+		for (int y = 0; y < 32; ++y) {
+			Uint32* line = reinterpret_cast<Uint32*>(static_cast<BYTE*>(pixels) + y * pitch);
+			uint64_t row = scr[y];
+			for (int x = 0; x < 64; ++x) {
+				// opaque black, or white when the bit is set
+				line[x] = 0xFF000000 | ((0u - (Uint32)((row >> (63 - x)) & 1)) & 0x00FFFFFF);
 			}
 		}
-		if (line_scan_on)
-			SDL_RenderPresent(renderer);
+		SDL_UnlockTexture(texture);
 	}
-	if (!line_scan_on)
-		SDL_RenderPresent(renderer);
+	SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+	TRACE_SCOPE("SDL_RenderPresent");
+	uint64_t start = Timer::nowNs();
+	SDL_RenderPresent(renderer);
+	if (present_time != nullptr) present_time->record(Timer::nowNs() - start);
 }
\ No newline at end of file
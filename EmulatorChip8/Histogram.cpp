@@ -0,0 +1,102 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include "Histogram.h"
+
+#include <SDL_bits.h>
+#include <cstring>
+
+LatencyHistogram::LatencyHistogram(const char* name) : name(name)
+{
+	clear();
+}
+
+void LatencyHistogram::clear()
+{
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+	sum = 0;
+	min = UINT64_MAX;
+	max = 0;
+}
+
+int LatencyHistogram::bucket_of(uint64_t ns)
+{
+	if (ns < (1u << SUB_BITS)) return (int)ns;
+	if (ns >> MAX_BITS) return BUCKETS - 1;
+	Uint32 high = (Uint32)(ns >> 32);
+	int msb = high != 0 ? 32 + SDL_MostSignificantBitIndex32(high) : SDL_MostSignificantBitIndex32((Uint32)ns);
+	// Keep the top SUB_BITS bits: the leading one picks the power of two,
+	// the SUB_BITS - 1 under it the bucket within it
+	int shift = msb - (SUB_BITS - 1);
+	int sub = (int)(ns >> shift) - (1 << (SUB_BITS - 1));
+	return (1 << SUB_BITS) + (shift - 1) * (1 << (SUB_BITS - 1)) + sub;
+}
+
+uint64_t LatencyHistogram::bucket_low(int bucket)
+{
+	if (bucket < (1 << SUB_BITS)) return (uint64_t)bucket;
+	int k = bucket - (1 << SUB_BITS);
+	int shift = k / (1 << (SUB_BITS - 1)) + 1;
+	uint64_t sub = (uint64_t)(k % (1 << (SUB_BITS - 1)) + (1 << (SUB_BITS - 1)));
+	return sub << shift;
+}
+
+uint64_t LatencyHistogram::bucket_high(int bucket)
+{
+	return bucket + 1 < BUCKETS ? bucket_low(bucket + 1) - 1 : UINT64_MAX;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	++counts[bucket_of(ns)];
+	++total;
+	sum += ns;
+	if (ns < min) min = ns;
+	if (ns > max) max = ns;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	if (total == 0) return 0;
+	uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+	if (rank < 1) rank = 1;
+	uint64_t seen = 0;
+	for (int b = 0; b < BUCKETS; ++b) {
+		seen += counts[b];
+		if (seen >= rank) return bucket_high(b) < max ? bucket_high(b) : max;
+	}
+	return max;
+}
+
+void LatencyHistogram::dump(FILE* out, bool buckets) const
+{
+	if (total == 0) {
+		fprintf(out, "%-10s no samples\n", name);
+		return;
+	}
+	fprintf(out, "%-10s n=%-8llu min %8.3fms  mean %8.3fms  p50 %8.3fms  p90 %8.3fms  p99 %8.3fms  p99.9 %8.3fms  max %8.3fms\n",
+		name, (unsigned long long)total, min / 1e6, (double)sum / total / 1e6,
+		percentile(50) / 1e6, percentile(90) / 1e6, percentile(99) / 1e6, percentile(99.9) / 1e6, max / 1e6);
+	if (!buckets) return;
+	for (int b = 0; b < BUCKETS; ++b) {
+		if (counts[b] == 0) continue;
+		fprintf(out, "%s,%llu,%llu,%llu\n", name, (unsigned long long)bucket_low(b),
+			(unsigned long long)bucket_high(b), (unsigned long long)counts[b]);
+	}
+}
@@ -0,0 +1,59 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+// Latency histogram with log-linear buckets, the layout of HdrHistogram:
+// values under 64ns get a bucket each, and every power of two above is split
+// into 32 equal buckets, so a value is known to within 1/32 (3%) whatever its
+// size, up to 2^40ns (18 minutes). The counts are one fixed array, recording
+// is a few instructions and never allocates, so it can stay on all the time.
+// Not synchronised: one thread records, and reading waits until it is done.
+class LatencyHistogram
+{
+public:
+	static const int SUB_BITS = 6;
+	static const int MAX_BITS = 40;
+	static const int BUCKETS = (1 << SUB_BITS) + (MAX_BITS - SUB_BITS) * (1 << (SUB_BITS - 1));
+
+	explicit LatencyHistogram(const char* name);
+
+	void record(uint64_t ns);
+	void clear();
+	uint64_t count() const { return total; }
+	// Highest value of the bucket holding the p-th percentile (0 to 100)
+	uint64_t percentile(double p) const;
+	// One line of count, min, mean, percentiles and max; with buckets, every
+	// bucket in use on a line of its own as "name,low_ns,high_ns,count"
+	void dump(FILE* out, bool buckets = false) const;
+
+private:
+	const char* name;
+	uint64_t counts[BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+
+	static int bucket_of(uint64_t ns);
+	static uint64_t bucket_low(int bucket);
+	static uint64_t bucket_high(int bucket);
+};
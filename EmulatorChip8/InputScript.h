@@ -0,0 +1,75 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include "Chip8.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Key input for headless runs. One "<frame> <key mask in hex>" per line, the
+// mask holding from that 60Hz frame on; '#' starts a comment:
+//
+//   0    0000
+//   120  0020   # hold key 5
+//   180  0000
+class InputScript {
+public:
+	bool load(const std::string& path) {
+		std::ifstream ifs(path);
+		if (!ifs.is_open()) return false;
+
+		events.clear();
+		std::string line;
+		while (std::getline(ifs, line)) {
+			line = line.substr(0, line.find('#'));
+			std::istringstream is(line);
+			DWORD frame;
+			unsigned int mask;
+			if (!(is >> frame)) {
+				if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+				return false;
+			}
+			if (!(is >> std::hex >> mask) || mask > 0xFFFF) return false;
+			events.push_back(Event{ frame, (WORD)mask });
+		}
+		std::stable_sort(events.begin(), events.end(),
+			[](const Event& a, const Event& b) { return a.frame < b.frame; });
+		return true;
+	}
+
+	bool empty() const { return events.empty(); }
+
+	// Keys held during the given frame
+	WORD keys_at(DWORD frame) const {
+		auto it = std::upper_bound(events.begin(), events.end(), frame,
+			[](DWORD f, const Event& e) { return f < e.frame; });
+		return it == events.begin() ? 0 : (it - 1)->keys;
+	}
+
+private:
+	struct Event {
+		DWORD frame;
+		WORD keys;
+	};
+	std::vector<Event> events;
+};
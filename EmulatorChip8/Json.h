@@ -0,0 +1,46 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+// The contents of a JSON string for s, without the quotes. Quotes, backslashes
+// and control characters are escaped; other bytes, UTF-8 included, pass through
+inline std::string json_escape(const std::string& s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (char c : s) {
+		unsigned char u = (unsigned char)c;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (u < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", u);
+			out += buf;
+		}
+		else {
+			out += c;
+		}
+	}
+	return out;
+}
@@ -0,0 +1,141 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include "Rewind.h"
+
+#include <cstring>
+
+// A delta is a list of runs: a 16 bit count of bytes to skip, a 16 bit
+// count of bytes to XOR in, then those bytes.
+
+static inline uint64_t load64(const BYTE* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+Rewind::Rewind(size_t bytes, size_t snapshots) : ring(bytes), entries(snapshots > 0 ? snapshots : 1),
+	first(0), count(0), tail(0), has_newest(false)
+{
+}
+
+void Rewind::clear()
+{
+	first = count = tail = 0;
+	has_newest = false;
+}
+
+size_t Rewind::bytes_used() const
+{
+	size_t used = 0;
+	for (size_t k = 0; k < count; ++k)
+		used += entries[(first + k) % entries.size()].size;
+	return used;
+}
+
+void Rewind::push(const Chip8State& state)
+{
+	if (has_newest) {
+		size_t size = _encode((const BYTE*)&newest, (const BYTE*)&state, scratch);
+		if (size > ring.size()) {
+			clear();
+		}
+		else {
+			size_t at = tail;
+			if (at + size > ring.size()) {
+				// No room before the end: the oldest entries, which lie past tail, go and writing starts over at 0
+				while (count > 0 && entries[first].offset >= tail) _drop_oldest();
+				at = 0;
+			}
+			while (count > 0 && (count == entries.size() ||
+				(entries[first].offset < at + size && at < entries[first].offset + entries[first].size))) {
+				_drop_oldest();
+			}
+			memcpy(&ring[at], scratch, size);
+			entries[(first + count) % entries.size()] = Entry{ at, size };
+			count++;
+			tail = at + size;
+		}
+	}
+	newest = state;
+	has_newest = true;
+}
+
+bool Rewind::pop(Chip8State& state)
+{
+	if (count == 0) return false;
+	const Entry& e = entries[(first + count - 1) % entries.size()];
+	_apply(&ring[e.offset], e.size, (BYTE*)&newest);
+	tail = e.offset;
+	count--;
+	state = newest;
+	return true;
+}
+
+size_t Rewind::_encode(const BYTE* a, const BYTE* b, BYTE* out)
+{
+	const size_t n = sizeof(Chip8State);
+	BYTE* p = out;
+	size_t pos = 0;
+	while (pos < n) {
+		// Skip what's unchanged, 8 bytes at a time while possible
+		size_t start = pos;
+		while (start + 8 <= n && load64(a + start) == load64(b + start)) start += 8;
+		while (start < n && a[start] == b[start]) start++;
+		if (start == n) break;
+
+		// Take changes in until 4 bytes in a row are the same
+		size_t end = start + 1;
+		for (size_t i = end; i < n && i - end < 4; ++i) {
+			if (a[i] != b[i]) end = i + 1;
+		}
+
+		uint16_t skip = (uint16_t)(start - pos), len = (uint16_t)(end - start);
+		memcpy(p, &skip, 2);
+		memcpy(p + 2, &len, 2);
+		p += 4;
+		for (size_t i = start; i < end; ++i)
+			*p++ = a[i] ^ b[i];
+		pos = end;
+	}
+	return p - out;
+}
+
+void Rewind::_apply(const BYTE* delta, size_t size, BYTE* state)
+{
+	const BYTE* end = delta + size;
+	size_t pos = 0;
+	while (delta < end) {
+		uint16_t skip, len;
+		memcpy(&skip, delta, 2);
+		memcpy(&len, delta + 2, 2);
+		delta += 4;
+		pos += skip;
+		for (uint16_t i = 0; i < len; ++i)
+			state[pos + i] ^= delta[i];
+		delta += len;
+		pos += len;
+	}
+}
+
+void Rewind::_drop_oldest()
+{
+	first = (first + 1) % entries.size();
+	count--;
+}
@@ -0,0 +1,66 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include "Chip8.h"
+
+#include <cstddef>
+#include <vector>
+
+// History of Chip8 states for stepping back in time, in a fixed amount of
+// memory. The newest state is kept whole; every older one is stored as the
+// XOR of it and its successor, run-length encoded, so the bytes that didn't
+// change between two snapshots (nearly all of memory and the screen) cost
+// nothing. When the ring is full the oldest snapshots are dropped.
+class Rewind {
+public:
+	// bytes of encoded history, and at most this many snapshots
+	Rewind(size_t bytes, size_t snapshots);
+
+	void clear();
+	// Appends the state the chip is in now
+	void push(const Chip8State& state);
+	// Steps back one snapshot: drops the newest and writes the one before it
+	// to state. False, leaving state alone, when there is nothing older.
+	bool pop(Chip8State& state);
+
+	size_t depth() const { return count; }
+	size_t bytes_used() const;
+
+private:
+	struct Entry {
+		size_t offset;
+		size_t size;
+	};
+
+	std::vector<BYTE> ring;
+	std::vector<Entry> entries; // ring of entries[first .. first + count)
+	size_t first;
+	size_t count;
+	size_t tail;                // end of the newest entry in ring
+	Chip8State newest;
+	bool has_newest;
+	// A run ends after 4 unchanged bytes, which pay for the next run's header,
+	// so no delta is more than one header longer than a state
+	BYTE scratch[sizeof(Chip8State) + 4];
+
+	size_t _encode(const BYTE* a, const BYTE* b, BYTE* out);
+	void _apply(const BYTE* delta, size_t size, BYTE* state);
+	void _drop_oldest();
+};
@@ -1,5 +1,7 @@
 #include "Timer.h"
 
+#include <chrono>
+
 void Timer::start() {
 	mStarted = true;
 	mPaused = false;
@@ -50,4 +52,10 @@ DWORD Timer::getTicks()
         }
     }
     return t;
+}
+
+uint64_t Timer::nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <windows.h>
 #include <SDL.h>
+#include <cstdint>
 
 class Timer
 {
@@ -14,6 +15,9 @@ public:
     
     DWORD getTicks();
 
+    // Nanoseconds on a steady clock, for timing finer than getTicks' milliseconds
+    static uint64_t nowNs();
+
     bool isStarted() const { return mStarted; }
     bool isPaused() const { return mPaused; }
 
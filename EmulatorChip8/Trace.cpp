@@ -0,0 +1,136 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#include "Trace.h"
+#include "Json.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+	// Per thread, a few minutes of a loop recording a handful of events a frame
+	const uint64_t RING_EVENTS = 1 << 16;
+
+	struct Event {
+		const char* name;
+		int64_t begin;
+		int64_t end;
+	};
+
+	// Written by its own thread only. head counts the events ever recorded, and
+	// its release store publishes the slot written before it
+	struct Ring {
+		Event events[RING_EVENTS];
+		std::atomic<uint64_t> head;
+		std::string name;
+		int tid;
+
+		Ring() : head(0), tid(0) {}
+	};
+
+	// The lock is taken once per thread, when its ring is made
+	std::mutex rings_lock;
+	std::vector<std::unique_ptr<Ring>> rings;
+	thread_local Ring* own_ring = nullptr;
+
+	std::basic_string<TCHAR> out_path;
+	std::chrono::steady_clock::time_point origin;
+
+	Ring& ring()
+	{
+		if (own_ring == nullptr) {
+			std::unique_ptr<Ring> made(new Ring);
+			std::lock_guard<std::mutex> lock(rings_lock);
+			made->tid = (int)rings.size() + 1;
+			own_ring = made.get();
+			rings.push_back(std::move(made));
+		}
+		return *own_ring;
+	}
+}
+
+bool Trace::on = false;
+
+void Trace::start(const TCHAR* path)
+{
+	out_path = path;
+	origin = std::chrono::steady_clock::now();
+	on = true;
+}
+
+int64_t Trace::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void Trace::name_thread(const char* name)
+{
+	if (on) ring().name = name;
+}
+
+void Trace::record(const char* name, int64_t begin, int64_t end)
+{
+	Ring& r = ring();
+	uint64_t head = r.head.load(std::memory_order_relaxed);
+	Event& e = r.events[head % RING_EVENTS];
+	e.name = name;
+	e.begin = begin;
+	e.end = end;
+	r.head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::flush()
+{
+	if (!on) return;
+	on = false;
+
+	FILE* f = nullptr;
+	if (_tfopen_s(&f, out_path.c_str(), TEXT("w")) != 0 || f == nullptr) {
+		_tprintf(TEXT("Failed to write the trace to %s\n"), out_path.c_str());
+		return;
+	}
+	// Complete ("X") events in microseconds
+	std::lock_guard<std::mutex> lock(rings_lock);
+	uint64_t written = 0;
+	const char* sep = "";
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (const auto& r : rings) {
+		if (!r->name.empty()) {
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				sep, r->tid, json_escape(r->name).c_str());
+			sep = ",\n";
+		}
+		uint64_t head = r->head.load(std::memory_order_acquire);
+		uint64_t first = head > RING_EVENTS ? head - RING_EVENTS : 0;
+		for (uint64_t i = first; i < head; ++i) {
+			const Event& e = r->events[i % RING_EVENTS];
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				sep, json_escape(e.name).c_str(), r->tid, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+			sep = ",\n";
+		}
+		written += head - first;
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(f);
+	_tprintf(TEXT("%llu trace events written to %s\n"), (unsigned long long)written, out_path.c_str());
+}
@@ -0,0 +1,66 @@
+/*
+	CHIP-8 Emulator
+
+	Copyright (C) 2020 Maoliang Li
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see https://www.gnu.org/licenses/
+*/
+#pragma once
+
+#include <cstdint>
+#include <tchar.h>
+
+// Timing of the main loop phases, written on exit as Chrome trace JSON for
+// chrome://tracing or ui.perfetto.dev. Only the time of hitches is worth
+// knowing, so recording has to be cheap enough to leave on: each thread
+// writes into a ring of its own with no lock, and the events are only turned
+// into JSON by flush(), once the other threads are done. A full ring drops its
+// oldest events, so a long session keeps the last few minutes.
+class Trace
+{
+public:
+	// Start recording, to be written to path by flush(). Call before the
+	// threads that record are started
+	static void start(const TCHAR* path);
+	static bool enabled() { return on; }
+	// Shown for the calling thread in the viewer
+	static void name_thread(const char* name);
+	// Nanoseconds since start()
+	static int64_t now();
+	// name must outlive the trace, a string literal
+	static void record(const char* name, int64_t begin, int64_t end);
+	static void flush();
+
+private:
+	static bool on;
+};
+
+// Records its lifetime as one event, when tracing is on
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* event) : name(Trace::enabled() ? event : nullptr), begin(name != nullptr ? Trace::now() : 0) {}
+	~TraceScope() { if (name) Trace::record(name, begin, Trace::now()); }
+
+private:
+	const char* name;
+	int64_t begin;
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free single producer / single consumer triple buffer.
+// The producer fills back() and publishes it; the consumer picks up the most
+// recently published slot with update() and reads it through front().
+// Neither side ever waits, frames the consumer did not get to are dropped.
+template <typename T>
+class TripleBuffer
+{
+public:
+    TripleBuffer() : mSlots(), mBack(0), mFront(1), mMiddle(2) {}
+
+    T& back() { return mSlots[mBack]; }
+    const T& front() const { return mSlots[mFront]; }
+
+    void publish()
+    {
+        mBack = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    bool update()
+    {
+        if (!(mMiddle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+private:
+    static const int INDEX = 0x3;
+    static const int FRESH = 0x4;
+
+    T mSlots[3];
+    int mBack;
+    // Owned by the producer
+    int mFront;
+    // Owned by the consumer
+    std::atomic<int> mMiddle;
+    // Slot index in between, with FRESH set until the consumer takes it
+};
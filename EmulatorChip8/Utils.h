@@ -6,7 +6,16 @@
 
 class Configure {
 public:
-	Configure() : FPS(200), default_rom(TEXT("")), keymap_stat(TEXT("off")), keymap_on(FALSE) {}
+	static const BYTE NO_KEY = 0xFF;
+
+	Configure() : IPS(600), Seed(0), RewindMB(4), RunAhead(0), Jit(FALSE), default_rom(TEXT("")), keymap_stat(TEXT("off")), trace_path(TEXT("")), latency_path(TEXT("")), keymap_on(FALSE) {
+		// The left of the keyboard stands in for the hex keypad:
+		//   1 2 3 4      1 2 3 C
+		//   Q W E R  ->  4 5 6 D
+		//   A S D F      7 8 9 E
+		//   Z X C V      A 0 B F
+		set_keymap(TEXT("x123qweasdzc4rfv"));
+	}
 	
 	int load_config() {
 		DWORD ret;
@@ -14,8 +23,15 @@ public:
 		TCHAR buffer[1023] = { 0 };
 		GetCurrentDirectory(sizeof(buffer), buffer);
 		_tprintf("%s\n", buffer);
+		int ips = GetPrivateProfileInt(TEXT("main"), TEXT("ips"), -1, config_path);
 		int fps = GetPrivateProfileInt(TEXT("main"), TEXT("fps"), -1, config_path);
-		if (fps > 0) FPS = fps;
+		if (ips > 0) IPS = ips;
+		else if (fps > 0) IPS = fps; // Older files set one instruction per frame
+		Seed = GetPrivateProfileInt(TEXT("main"), TEXT("seed"), 0, config_path);
+		RewindMB = GetPrivateProfileInt(TEXT("main"), TEXT("rewind_mb"), 4, config_path);
+		RunAhead = GetPrivateProfileInt(TEXT("main"), TEXT("runahead"), 0, config_path);
+		if (RunAhead > 8) RunAhead = 8;
+		Jit = GetPrivateProfileInt(TEXT("main"), TEXT("jit"), 0, config_path) != 0;
 		ret = GetPrivateProfileString(TEXT("main"), TEXT("default_rom"), TEXT(""), 
 			buffer, sizeof(buffer) / sizeof(TCHAR), config_path); // To avoid overflow
 		if (_tcslen(buffer) > 3) {
@@ -26,6 +42,14 @@ public:
 			return 1;
 		}
 		memset(buffer, 0, sizeof(buffer));
+		ret = GetPrivateProfileString(TEXT("main"), TEXT("trace"), TEXT(""),
+			buffer, sizeof(buffer) / sizeof(TCHAR), config_path);
+		_tcscpy_s(trace_path, sizeof(trace_path) / sizeof(TCHAR), buffer);
+		memset(buffer, 0, sizeof(buffer));
+		ret = GetPrivateProfileString(TEXT("main"), TEXT("latency"), TEXT(""),
+			buffer, sizeof(buffer) / sizeof(TCHAR), config_path);
+		_tcscpy_s(latency_path, sizeof(latency_path) / sizeof(TCHAR), buffer);
+		memset(buffer, 0, sizeof(buffer));
 		ret = GetPrivateProfileString(TEXT("main"), TEXT("keymap_on"), TEXT(""),
 			buffer, sizeof(buffer) / sizeof(TCHAR), config_path); // To avoid overflow
 		if (_tcslen(buffer) > 1) {
@@ -43,14 +67,13 @@ public:
 				buffer, sizeof(buffer) / sizeof(TCHAR), config_path);
 			if (_tcslen(buffer) == 16) {
 				for (register int i = 0; i < 16; ++i) {
-					if (32 <= buffer[i] && buffer[i] <= 126)
-						keymap[buffer[i]] = i;
-					else {
+					if (buffer[i] < 32 || buffer[i] > 126) {
 						_tprintf(TEXT("Warning: keymap remapping failed due to invalid character.\n"));
 						keymap_on = FALSE;
 						break;
 					}
 				}
+				if (keymap_on) set_keymap(buffer);
 			}
 			else {
 				_tprintf(TEXT("Warning: keymap remapping failed due to incorrect format.\n"));
@@ -75,24 +98,72 @@ public:
 		return keymap_stat;
 	}
 
-	DWORD get_fps() {		
-		return FPS;
+	DWORD get_ips() {
+		return IPS;
+	}
+
+	// 0 when the ini doesn't fix one
+	DWORD get_seed() {
+		return Seed;
+	}
+
+	// Memory for rewinding, 0 turns it off
+	DWORD get_rewind_mb() {
+		return RewindMB;
+	}
+
+	// Frames shown ahead of the emulation, 0 for none
+	DWORD get_runahead() {
+		return RunAhead;
+	}
+
+	// Run through Chip8Jit instead of Chip8::run_frame
+	BOOL get_jit() {
+		return Jit;
+	}
+
+	// Chrome trace written on exit, nullptr for none
+	TCHAR* get_trace() {
+		return trace_path[0] != 0 ? trace_path : nullptr;
+	}
+
+	// Latency histogram buckets written on exit, nullptr for none
+	TCHAR* get_latency() {
+		return latency_path[0] != 0 ? latency_path : nullptr;
 	}
 
 	BOOL get_keymap_on() {
 		return keymap_on;
 	}
 
-	BYTE* get_keymap() {
-		return keymap;
+	// Chip8 key for an SDL key code, NO_KEY if it isn't mapped
+	BYTE key_of(int sym) {
+		return sym >= 0 && sym < 256 ? keymap[sym] : NO_KEY;
 	}
 
 private:
 	TCHAR default_rom[1024];
 	TCHAR keymap_stat[1024];
-	DWORD FPS;
+	TCHAR trace_path[1024];
+	TCHAR latency_path[1024];
+	DWORD IPS;
+	DWORD Seed;
+	DWORD RewindMB;
+	DWORD RunAhead;
+	BOOL Jit;
 	BOOL keymap_on;
-	BYTE keymap[256] = { 0 };
+	BYTE keymap[256];
+
+	// layout[k] is the character for Chip8 key k, letters match in either case
+	void set_keymap(const TCHAR* layout) {
+		memset(keymap, NO_KEY, sizeof(keymap));
+		for (int k = 0; k < 16; ++k) {
+			BYTE c = (BYTE)layout[k];
+			keymap[c] = k;
+			if ('a' <= c && c <= 'z') keymap[c - 'a' + 'A'] = k;
+			if ('A' <= c && c <= 'Z') keymap[c - 'A' + 'a'] = k;
+		}
+	}
 };
 
 TCHAR* Open_file_dialog(TCHAR* init_dir = nullptr) {